@@ -0,0 +1,234 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sgpt.h"
+
+// Prints one JSON document of the form {"n_cpus": n, "results": [...]} on
+// stdout, with an object per measurement, so that runs can be compared across
+// commits.
+
+// Each measurement repeats its run for at least this long and reports the
+// fastest repetition, which is the least disturbed by the rest of the system.
+static const double MIN_TIME_NS = 50e6;
+static const int MIN_ITERS = 3;
+
+static bool first_result = true;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+// Starts the next object of the results array.
+static void begin_result(const char* bench) {
+  printf("%s\n    {\"bench\": \"%s\"", first_result ? "" : ",", bench);
+  first_result = false;
+}
+
+static void end_result(void) { printf("}"); }
+
+typedef struct bench_time {
+  int iters;
+  double best_ns;
+} bench_time;
+
+static bench_time time_plan(sgpt_context* ctx, const sgpt_cplan* plan) {
+  // one untimed run faults the pages in and spawns the threads
+  sgpt_plan_execute(ctx, plan);
+  bench_time t = {.iters = 0, .best_ns = 0.0};
+  const double t_start = now_ns();
+  while (t.iters < MIN_ITERS || now_ns() - t_start < MIN_TIME_NS) {
+    const double t0 = now_ns();
+    sgpt_plan_execute(ctx, plan);
+    const double dt = now_ns() - t0;
+    if (t.iters == 0 || dt < t.best_ns) t.best_ns = dt;
+    t.iters++;
+  }
+  return t;
+}
+
+// Gives t deterministic values in [-1, 1), converted to the type of t.
+static void fill(sgpt_context* ctx, sgpt_tensor* t) {
+  sgpt_tensor* const x = sgpt_new_tensor_4d(ctx, SGPT_TYPE_F32, t->ne[0],
+                                            t->ne[1], t->ne[2], t->ne[3]);
+  const int64_t n = t->ne[0] * t->ne[1] * t->ne[2] * t->ne[3];
+  float* const data = x->data;
+  uint32_t seed = 1;
+  for (int64_t i = 0; i < n; i++) {
+    seed = seed * 1664525u + 1013904223u;
+    data[i] = (float)(seed >> 8) / (float)(1 << 23) - 1.0f;
+  }
+  sgpt_graph_compute(ctx, sgpt_build_forward(ctx, sgpt_cpy(ctx, x, t)));
+}
+
+typedef enum bench_layout {
+  LAYOUT_CONTIGUOUS = 0,
+  LAYOUT_TRANSPOSED, // src0 is a transposed view
+  LAYOUT_BROADCAST, // src1 of add is a single row
+} bench_layout;
+
+static const char* const LAYOUT_NAMES[] = {
+    [LAYOUT_CONTIGUOUS] = "contiguous",
+    [LAYOUT_TRANSPOSED] = "transposed",
+    [LAYOUT_BROADCAST] = "broadcast",
+};
+
+// Times a single add or dup of ne0 x ne1 elements of type, counting the bytes
+// of every operand once.
+static void bench_kernel(sgpt_op op, sgpt_type type, int64_t ne0, int64_t ne1,
+                         bench_layout layout, int n_threads) {
+  const size_t nbytes = sgpt_row_size(type, ne0) * ne1;
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4 * nbytes + 2 * sizeof(float) * ne0 * ne1 + 1024 * 1024,
+      .mem_buffer = NULL,
+      .n_threads = n_threads,
+  });
+
+  sgpt_tensor* a;
+  if (layout == LAYOUT_TRANSPOSED) {
+    sgpt_tensor* const at = sgpt_new_tensor_2d(ctx, type, ne1, ne0);
+    fill(ctx, at);
+    a = sgpt_transpose(ctx, at);
+  } else {
+    a = sgpt_new_tensor_2d(ctx, type, ne0, ne1);
+    fill(ctx, a);
+  }
+  sgpt_tensor* result;
+  size_t bytes = 2 * nbytes;
+  if (op == SGPT_OP_ADD) {
+    sgpt_tensor* const b = sgpt_new_tensor_2d(
+        ctx, type, ne0, layout == LAYOUT_BROADCAST ? 1 : ne1);
+    fill(ctx, b);
+    bytes += sgpt_row_size(type, ne0) * b->ne[1];
+    result = sgpt_add(ctx, a, b);
+  } else {
+    result = sgpt_dup(ctx, a);
+  }
+
+  sgpt_cgraph* const gf = sgpt_build_forward(ctx, result);
+  const sgpt_cplan* const plan = sgpt_graph_plan(ctx, gf);
+  const bench_time t = time_plan(ctx, plan);
+
+  begin_result(op == SGPT_OP_ADD ? "add" : "dup");
+  printf(", \"type\": \"%s\", \"ne\": [%lld, %lld], \"layout\": \"%s\"",
+         sgpt_type_name(type), (long long)ne0, (long long)ne1,
+         LAYOUT_NAMES[layout]);
+  printf(", \"n_threads\": %d, \"iters\": %d, \"ns\": %.0f", n_threads,
+         t.iters, t.best_ns);
+  printf(", \"ns_per_elem\": %.4f, \"gb_per_s\": %.2f",
+         t.best_ns / (double)(ne0 * ne1), (double)bytes / t.best_ns);
+  end_result();
+  sgpt_free(ctx);
+}
+
+// Builds a chain of n_nodes adds of n elements.
+static sgpt_tensor* build_chain(sgpt_context* ctx, int n_nodes, int64_t n) {
+  sgpt_tensor* const b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  sgpt_tensor* x = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  memset(b->data, 0, sizeof(float) * n);
+  memset(x->data, 0, sizeof(float) * n);
+  for (int i = 0; i < n_nodes; i++) x = sgpt_add(ctx, x, b);
+  return x;
+}
+
+// Times sgpt_build_forward on a chain of n_nodes adds.
+static void bench_build_forward(int n_nodes) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024 * 1024,
+      .mem_buffer = NULL,
+  });
+  sgpt_tensor* const x = build_chain(ctx, n_nodes, 1);
+
+  const int n_iter = 20;
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, n_nodes);
+  const double t_start = now_ns();
+  for (int i = 0; i < n_iter; i++) {
+    sgpt_graph_reset(gf);
+    sgpt_build_forward_expand(gf, x);
+  }
+  const double t_total = now_ns() - t_start;
+
+  begin_result("build_forward");
+  printf(", \"n_nodes\": %d, \"n_leafs\": %d, \"ns\": %.0f", gf->n_nodes,
+         gf->n_leafs, t_total / n_iter);
+  printf(", \"ns_per_node\": %.2f", t_total / n_iter / gf->n_nodes);
+  end_result();
+  sgpt_free(ctx);
+}
+
+// Times sgpt_graph_compute, which plans the graph on every call, on a chain of
+// n_nodes adds of n elements.
+static void bench_graph_compute(int n_nodes, int64_t n, int n_threads) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = (size_t)(n_nodes + 2) * (sizeof(float) * n + 1024) +
+                  1024 * 1024,
+      .mem_buffer = NULL,
+      .n_threads = n_threads,
+  });
+  sgpt_cgraph* const gf = sgpt_new_graph(ctx, n_nodes);
+  sgpt_build_forward_expand(gf, build_chain(ctx, n_nodes, n));
+
+  sgpt_graph_compute(ctx, gf);
+  int iters = 0;
+  double best_ns = 0.0;
+  const double t_start = now_ns();
+  while (iters < MIN_ITERS || now_ns() - t_start < MIN_TIME_NS) {
+    const double t0 = now_ns();
+    sgpt_graph_compute(ctx, gf);
+    const double dt = now_ns() - t0;
+    if (iters == 0 || dt < best_ns) best_ns = dt;
+    iters++;
+  }
+
+  begin_result("graph_compute");
+  printf(", \"n_nodes\": %d, \"ne\": [%lld], \"n_threads\": %d", gf->n_nodes,
+         (long long)n, n_threads);
+  printf(", \"iters\": %d, \"ns\": %.0f, \"ns_per_node\": %.2f", iters,
+         best_ns, best_ns / gf->n_nodes);
+  end_result();
+  sgpt_free(ctx);
+}
+
+int main(void) {
+  const int n_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int n_threads[8];
+  int n_counts = 0;
+  for (int n = 1; n < n_cpus && n_counts < 7; n *= 2) n_threads[n_counts++] = n;
+  n_threads[n_counts++] = n_cpus > 0 ? n_cpus : 1;
+
+  // one shape that fits in the L2 cache and one that streams from memory
+  const int64_t shapes[][2] = {{256, 64}, {4096, 1024}};
+
+  printf("{\n  \"n_cpus\": %d,\n  \"results\": [", n_cpus);
+  for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+    for (int type = 0; type < SGPT_TYPE_COUNT; type++) {
+      // quantized blocks only run along dimension 0
+      const bool blocked = sgpt_blck_size(type) > 1;
+      for (int t = 0; t < n_counts; t++) {
+        const int64_t ne0 = shapes[s][0];
+        const int64_t ne1 = shapes[s][1];
+        for (int layout = 0; layout <= LAYOUT_BROADCAST; layout++) {
+          if (blocked && layout == LAYOUT_TRANSPOSED) continue;
+          bench_kernel(SGPT_OP_ADD, type, ne0, ne1, layout, n_threads[t]);
+          if (layout != LAYOUT_BROADCAST) {
+            bench_kernel(SGPT_OP_DUP, type, ne0, ne1, layout, n_threads[t]);
+          }
+        }
+      }
+    }
+  }
+  for (int n_nodes = 512; n_nodes <= 65536; n_nodes *= 2) {
+    bench_build_forward(n_nodes);
+  }
+  for (int n_nodes = 64; n_nodes <= 4096; n_nodes *= 4) {
+    bench_graph_compute(n_nodes, 1024, 1);
+    if (n_cpus > 1) bench_graph_compute(n_nodes, 1024, n_cpus);
+  }
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -3,20 +3,36 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 typedef enum sgpt_op {
   SGPT_OP_NONE = 0,
   SGPT_OP_DUP,
   SGPT_OP_ADD,
+  SGPT_OP_ADD_N, // sum of srcs, produced by sgpt_graph_fuse
+  SGPT_OP_COUNT,
 } sgpt_op;
 
 typedef enum sgpt_type {
   SGPT_TYPE_F32 = 0,
   SGPT_TYPE_I32,
+  SGPT_TYPE_F16,
+  SGPT_TYPE_BF16,
+  SGPT_TYPE_Q8_0, // blocks of SGPT_QK int8 quants with an f16 scale
+  SGPT_TYPE_Q4_0, // blocks of SGPT_QK 4 bit quants with an f16 scale
   SGPT_TYPE_COUNT,
 } sgpt_type;
 
+// Elements per block of the quantized types. ne[0] of their tensors must be a
+// multiple of it, and nb[0] is the size of a block.
+#define SGPT_QK 32
+
+// IEEE half precision and bfloat16 (the top half of an f32) values
+typedef uint16_t sgpt_fp16_t;
+typedef uint16_t sgpt_bf16_t;
+
 #define SGPT_MAX_DIMS 4
+#define SGPT_MAX_NAME 64
 typedef struct sgpt_tensor {
   sgpt_type type;
   int n_dims;
@@ -25,36 +41,129 @@ typedef struct sgpt_tensor {
   sgpt_op op;
   struct sgpt_tensor* src0;
   struct sgpt_tensor* src1;
+  int n_srcs;
+  struct sgpt_tensor** srcs; // every source of a fused op, NULL otherwise
+  struct sgpt_tensor* view_src; // tensor owning data when this is a view
+  size_t view_offs; // offset of data in the data of view_src
   void* data;
+  char name[SGPT_MAX_NAME]; // empty unless set, see sgpt_set_name
 } sgpt_tensor;
 
-#define SGPT_MAX_NODES 4096
+// What one node of a profiled graph cost in its last compute
+typedef struct sgpt_perf {
+  int64_t t_start_ns; // since the start of the compute
+  int64_t t_ns; // wall time, until every thread is done with the node
+  uint64_t cycles; // time stamp counter ticks, 0 where there is none
+  size_t bytes_read; // size of every source, once each
+  size_t bytes_written;
+  int n_threads; // tasks the node was split into
+} sgpt_perf;
+
+// A graph of size nodes and leafs takes about 88 * size bytes of its context,
+// for the node, leaf and output lists, the visited set and the traversal
+// stack.
+#define SGPT_DEFAULT_GRAPH_SIZE 4096
+struct sgpt_visit_frame;
 typedef struct sgpt_cgraph {
+  int size; // capacity of both nodes and leafs
   int n_nodes;
   int n_leafs;
-  struct sgpt_tensor* nodes[SGPT_MAX_NODES];
-  struct sgpt_tensor* leafs[SGPT_MAX_NODES];
+  struct sgpt_tensor** nodes;
+  struct sgpt_tensor** leafs;
+  size_t visited_hash_size;
+  struct sgpt_tensor** visited_hash_table;
+  struct sgpt_visit_frame* visit_stack; // scratch of sgpt_build_forward_expand
+  int n_outputs;
+  struct sgpt_tensor** outputs; // every tensor passed to the expand, once
+  sgpt_perf* perf; // one per node when profiling, see sgpt_graph_profile
 } sgpt_cgraph;
 
+// A graph compiled for repeated execution: every node is resolved to its
+// kernel and its split among threads. Valid until the graph is rebuilt.
+struct sgpt_plan_node;
+typedef struct sgpt_cplan {
+  int n_threads;
+  int n_nodes;
+  struct sgpt_plan_node* nodes;
+  sgpt_perf* perf; // of the graph, filled in by every execution when set
+} sgpt_cplan;
+
+typedef enum sgpt_object_type {
+  SGPT_OBJECT_TENSOR = 0,
+  SGPT_OBJECT_GRAPH,
+  SGPT_OBJECT_PLAN,
+  SGPT_OBJECT_BUFFER,
+} sgpt_object_type;
+
 typedef struct sgpt_object {
   size_t offset;
   size_t size;
   struct sgpt_object* next;
+  sgpt_object_type type;
+  size_t padding; // bytes skipped to align the data of a tensor
 } sgpt_object;
 
+struct sgpt_threadpool;
+struct sgpt_mapping;
+struct sgpt_name_index;
+
 typedef struct sgpt_context {
   size_t mem_size;
   void* mem_buffer;
   int n_objects;
   sgpt_object* objects_begin;
   sgpt_object* objects_end;
+  int n_threads;
+  struct sgpt_threadpool* threadpool; // spawned by the first parallel compute
+  size_t data_alignment;
+  bool mem_buffer_owned; // allocated by sgpt_init and released by sgpt_free
+  size_t mem_mapped_size; // non-zero when the owned buffer was mmap-ed
+  // whether the kernel accepted mem_hugepages and mem_lock, which fall back to
+  // normal pages and swappable memory when it does not
+  bool mem_hugepages;
+  bool mem_locked;
+  bool measure;
+  size_t mem_needed; // bytes of mem_buffer used, or needed if measure is set
+  struct sgpt_mapping* mappings; // files mapped by sgpt_load
+  struct sgpt_name_index* names; // named tensors, see sgpt_get_tensor
 } sgpt_context;
 
+#define SGPT_DEFAULT_DATA_ALIGNMENT 64
 typedef struct sgpt_init_params {
   size_t mem_size;
+  // NULL lets sgpt_init allocate mem_size bytes, and it returns NULL if they
+  // cannot be allocated
   void* mem_buffer;
+  // options for a buffer allocated by sgpt_init, any of them uses mmap
+  bool mem_hugepages; // ask for transparent huge pages with MADV_HUGEPAGE
+  bool mem_populate; // fault every page in up front
+  bool mem_lock; // mlock the buffer so that it is never swapped out
+  // tensors get no data and the context only counts the bytes they would
+  // take, see sgpt_used_mem. Graphs built in it can be computed once
+  // sgpt_graph_alloc has given their tensors data in another context.
+  bool measure;
+  int n_threads; // threads used by sgpt_graph_compute, 0 means 1
+  size_t data_alignment; // power of two, 0 means SGPT_DEFAULT_DATA_ALIGNMENT
 } sgpt_init_params;
 sgpt_context* sgpt_init(sgpt_init_params params);
+void sgpt_free(sgpt_context* ctx);
+
+// A point in the object list of a context. Rolling back to it releases every
+// object created after the mark in O(1).
+typedef struct sgpt_arena_mark {
+  int n_objects;
+  sgpt_object* objects_end;
+  size_t offset; // end of the last object in mem_buffer
+  size_t mem_needed;
+  size_t n_names; // names set before the mark
+} sgpt_arena_mark;
+sgpt_arena_mark sgpt_mark(const sgpt_context* ctx);
+void sgpt_rollback(sgpt_context* ctx, sgpt_arena_mark mark);
+
+// Bytes of mem_buffer taken by the objects of the context. For a measure
+// context, the exact mem_size a context allocated by sgpt_init needs for the
+// same objects.
+size_t sgpt_used_mem(const sgpt_context* ctx);
 
 sgpt_tensor* sgpt_new_tensor_1d(
   sgpt_context* ctx,
@@ -85,6 +194,46 @@ sgpt_tensor* sgpt_new_tensor_4d(
 
 sgpt_tensor* sgpt_dup_tensor(sgpt_context* ctx, const sgpt_tensor* src);
 sgpt_tensor* sgpt_view_tensor(sgpt_context* ctx, const sgpt_tensor* src);
+// Names a tensor of ctx and indexes it for sgpt_get_tensor. name is shorter
+// than SGPT_MAX_NAME bytes, and an empty name leaves the tensor unindexed.
+// Returns tensor.
+sgpt_tensor* sgpt_set_name(sgpt_context* ctx, sgpt_tensor* tensor,
+                           const char* name);
+const char* sgpt_get_name(const sgpt_tensor* tensor);
+// The tensor of ctx that was named name first, or NULL, in constant time.
+// Names set after a mark are forgotten by sgpt_rollback, also those of
+// tensors that were created before it.
+sgpt_tensor* sgpt_get_tensor(const sgpt_context* ctx, const char* name);
+
+// Views alias the data of a without copying it. offset is in bytes from the
+// start of a, nb1..nb3 are the strides of the view.
+sgpt_tensor* sgpt_view_1d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          size_t offset);
+sgpt_tensor* sgpt_view_2d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          int64_t ne1, size_t nb1, size_t offset);
+sgpt_tensor* sgpt_view_3d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          int64_t ne1, int64_t ne2, size_t nb1, size_t nb2,
+                          size_t offset);
+sgpt_tensor* sgpt_view_4d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          int64_t ne1, int64_t ne2, int64_t ne3, size_t nb1,
+                          size_t nb2, size_t nb3, size_t offset);
+
+// a must be contiguous. sgpt_reshape takes the shape of b.
+sgpt_tensor* sgpt_reshape(sgpt_context* ctx, sgpt_tensor* a,
+                          const sgpt_tensor* b);
+sgpt_tensor* sgpt_reshape_1d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0);
+sgpt_tensor* sgpt_reshape_2d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                             int64_t ne1);
+sgpt_tensor* sgpt_reshape_3d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                             int64_t ne1, int64_t ne2);
+sgpt_tensor* sgpt_reshape_4d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                             int64_t ne1, int64_t ne2, int64_t ne3);
+
+// Moves dimension i of a to dimension axis<i> of the result.
+sgpt_tensor* sgpt_permute(sgpt_context* ctx, sgpt_tensor* a, int axis0,
+                          int axis1, int axis2, int axis3);
+// Swaps the first two dimensions.
+sgpt_tensor* sgpt_transpose(sgpt_context* ctx, sgpt_tensor* a);
 
 int32_t sgpt_get_i32_1d(const sgpt_tensor* tensor, int i0);
 int32_t sgpt_get_i32_2d(const sgpt_tensor* tensor, int i0, int i1);
@@ -96,10 +245,95 @@ void sgpt_set_i32_2d(sgpt_tensor* tensor, int i0, int i1, int32_t value);
 void sgpt_set_i32_3d(sgpt_tensor* tensor, int i0, int i1, int i2, int32_t value);
 void sgpt_set_i32_4d(sgpt_tensor* tensor, int i0, int i1, int i2, int i3, int32_t value);
 
+// Elements per block, bytes per block and bytes of a row of ne0 elements
+int64_t sgpt_blck_size(sgpt_type type);
+size_t sgpt_type_size(sgpt_type type);
+size_t sgpt_row_size(sgpt_type type, int64_t ne0);
+// Bytes spanned by the data of the tensor, gaps of strided views included
+size_t sgpt_nbytes(const sgpt_tensor* tensor);
+const char* sgpt_type_name(sgpt_type type);
+const char* sgpt_op_name(sgpt_op op);
+
+float sgpt_fp16_to_fp32(sgpt_fp16_t h);
+sgpt_fp16_t sgpt_fp32_to_fp16(float f);
+float sgpt_bf16_to_fp32(sgpt_bf16_t h);
+sgpt_bf16_t sgpt_fp32_to_bf16(float f);
+void sgpt_fp16_to_fp32_row(const sgpt_fp16_t* x, float* y, int64_t n);
+void sgpt_fp32_to_fp16_row(const float* x, sgpt_fp16_t* y, int64_t n);
+void sgpt_bf16_to_fp32_row(const sgpt_bf16_t* x, float* y, int64_t n);
+void sgpt_fp32_to_bf16_row(const float* x, sgpt_bf16_t* y, int64_t n);
+
 sgpt_tensor* sgpt_dup(sgpt_context* ctx, sgpt_tensor* a);
 sgpt_tensor* sgpt_dup_inplace(sgpt_context* ctx, sgpt_tensor* a);
+// The type of the sum of tensors of types a and b: their type when they are
+// the same, f32 otherwise.
+sgpt_type sgpt_promote_type(sgpt_type a, sgpt_type b);
+// Converts a to type. Float to i32 truncates toward zero.
+sgpt_tensor* sgpt_cast(sgpt_context* ctx, sgpt_tensor* a, sgpt_type type);
+// b is broadcast to the shape of a along the dimensions where it has size 1.
+// The result has the promoted type of a and b, or the type of a in place.
+// Mixed types and half precision and quantized types are summed in f32, and
+// a quantized result is quantized again.
 sgpt_tensor* sgpt_add(sgpt_context* ctx, sgpt_tensor* a, sgpt_tensor* b);
 sgpt_tensor* sgpt_add_inplace(sgpt_context* ctx, sgpt_tensor* a, sgpt_tensor* b);
+// Copies a into b, converting it to the type of b, which quantizes or
+// dequantizes it for the quantized types. Returns a view of b.
+sgpt_tensor* sgpt_cpy(sgpt_context* ctx, sgpt_tensor* a, sgpt_tensor* b);
+
+sgpt_cgraph* sgpt_new_graph(sgpt_context* ctx, int size);
+void sgpt_graph_reset(sgpt_cgraph* cgraph);
+void sgpt_build_forward_expand(sgpt_cgraph* cgraph, sgpt_tensor* tensor);
+// A new graph of tensor, just large enough for it, so it has no room to
+// expand more tensors into.
+sgpt_cgraph* sgpt_build_forward(sgpt_context* ctx, sgpt_tensor* tensor);
 
-sgpt_cgraph sgpt_build_forward(sgpt_tensor* tensor);
+// Gives data to the tensors of the graph that have none, typically built in a
+// measure context, from one scratch buffer allocated in ctx. Intermediates
+// share memory once nothing reads them and element-wise ops overwrite their
+// input in place when it is safe, so only tensors without consumers in the
+// graph and those passed to sgpt_build_forward_expand keep their values after
+// compute. Returns the scratch buffer size.
+size_t sgpt_graph_alloc(sgpt_context* ctx, sgpt_cgraph* cgraph);
+
+// Merges chains of element-wise nodes into single nodes that read every input
+// once and write only their result. A node is merged into the node reading it
+// when nothing else reads or views it and it was not passed to
+// sgpt_build_forward_expand, so the merged intermediates are never computed.
+// Call it on a complete graph, before sgpt_graph_alloc. Float sums may be
+// reassociated. Returns the number of nodes removed.
+int sgpt_graph_fuse(sgpt_context* ctx, sgpt_cgraph* cgraph);
 void sgpt_graph_compute(sgpt_context* ctx, sgpt_cgraph* cgraph);
+
+sgpt_cplan* sgpt_graph_plan(sgpt_context* ctx, const sgpt_cgraph* cgraph);
+void sgpt_plan_execute(sgpt_context* ctx, const sgpt_cplan* plan);
+
+// Makes every later compute of the graph, and execution of the plans made
+// from it after this call, record an sgpt_perf per node in cgraph->perf. The
+// records are allocated in ctx.
+void sgpt_graph_profile(sgpt_context* ctx, sgpt_cgraph* cgraph);
+// Prints the recorded time of the nodes by op and type, slowest first.
+void sgpt_graph_print_profile(const sgpt_cgraph* cgraph, FILE* f);
+// Writes the recorded nodes as Chrome trace events, which Perfetto and
+// chrome://tracing open. Returns false when the file cannot be written.
+bool sgpt_graph_export_trace(const sgpt_cgraph* cgraph, const char* path);
+
+// Write the graph as Graphviz DOT or as JSON. Every tensor shows its name, op,
+// type, ne, nb, size in bytes, whether it overwrites the data of its src0
+// and, when the graph is profiled, the time of its last compute. Tensors are
+// identified by their address. Return false when the file cannot be written.
+bool sgpt_graph_dump_dot(const sgpt_cgraph* cgraph, const char* path);
+bool sgpt_graph_dump_json(const sgpt_cgraph* cgraph, const char* path);
+
+// Writes the named, contiguous tensors to a file: a header, a table with the
+// name, type, ne and data offset of every tensor, then their data, each at an
+// offset aligned to SGPT_DEFAULT_DATA_ALIGNMENT. Returns false when the file
+// cannot be written.
+bool sgpt_save(const char* path, sgpt_tensor* const* tensors, int n_tensors);
+// Maps a file written by sgpt_save and creates its tensors in ctx, with their
+// data in the mapping, so only the table is read up front. Writes to the data
+// are private to the process. The first max_tensors tensors are stored in
+// tensors, in the order of the file. The mapping lives until sgpt_free, also
+// when the tensors are rolled back. Returns the number of tensors in the
+// file, or -1 when it cannot be mapped or is not valid.
+int sgpt_load(sgpt_context* ctx, const char* path, sgpt_tensor** tensors,
+              int max_tensors);
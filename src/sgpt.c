@@ -1,399 +1,3458 @@
+#define _GNU_SOURCE  // MAP_ANONYMOUS, MAP_POPULATE and MADV_HUGEPAGE
+
 #include "sgpt.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SGPT_X86 1
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define SGPT_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define SGPT_MAX(a, b) ((a) > (b) ? (a) : (b))
+#define SGPT_PAD(x, n) (((x) + (n) - 1) / (n) * (n))
+
+#define SGPT_OBJECT_ALIGN 16
 
+// Bytes of a block of SGPT_BLCK_SIZE elements, which is nb[0] of tensors
 static const size_t SGPT_TYPE_SIZE[SGPT_TYPE_COUNT] = {
     [SGPT_TYPE_F32] = sizeof(float),
     [SGPT_TYPE_I32] = sizeof(int32_t),
+    [SGPT_TYPE_F16] = sizeof(sgpt_fp16_t),
+    [SGPT_TYPE_BF16] = sizeof(sgpt_bf16_t),
+    [SGPT_TYPE_Q8_0] = sizeof(sgpt_fp16_t) + SGPT_QK,
+    [SGPT_TYPE_Q4_0] = sizeof(sgpt_fp16_t) + SGPT_QK / 2,
 };
 
-static sgpt_context ctx;
-sgpt_context* sgpt_init(sgpt_init_params params) {
-  ctx = (sgpt_context){
-      .mem_size = params.mem_size,
-      .mem_buffer = params.mem_buffer,
-      .n_objects = 0,
-      .objects_begin = NULL,
-      .objects_end = NULL,
-  };
-  return &ctx;
+static const int64_t SGPT_BLCK_SIZE[SGPT_TYPE_COUNT] = {
+    [SGPT_TYPE_F32] = 1,
+    [SGPT_TYPE_I32] = 1,
+    [SGPT_TYPE_F16] = 1,
+    [SGPT_TYPE_BF16] = 1,
+    [SGPT_TYPE_Q8_0] = SGPT_QK,
+    [SGPT_TYPE_Q4_0] = SGPT_QK,
+};
+
+static const char* const SGPT_TYPE_NAME[SGPT_TYPE_COUNT] = {
+    [SGPT_TYPE_F32] = "f32",   [SGPT_TYPE_I32] = "i32",
+    [SGPT_TYPE_F16] = "f16",   [SGPT_TYPE_BF16] = "bf16",
+    [SGPT_TYPE_Q8_0] = "q8_0", [SGPT_TYPE_Q4_0] = "q4_0",
+};
+
+static const char* const SGPT_OP_NAME[SGPT_OP_COUNT] = {
+    [SGPT_OP_NONE] = "NONE",
+    [SGPT_OP_DUP] = "DUP",
+    [SGPT_OP_ADD] = "ADD",
+    [SGPT_OP_ADD_N] = "ADD_N",
+};
+
+static inline float sgpt_fp32_from_bits(uint32_t w) {
+  float f;
+  memcpy(&f, &w, sizeof(f));
+  return f;
 }
 
-static inline bool sgpt_are_same_shape(const sgpt_tensor* a,
-                                       const sgpt_tensor* b) {
-  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
-  return ((a->ne[0] == b->ne[0]) && (a->ne[1] == b->ne[1]) &&
-          (a->ne[2] == b->ne[2]) && (a->ne[3] == b->ne[3]));
+static inline uint32_t sgpt_fp32_to_bits(float f) {
+  uint32_t w;
+  memcpy(&w, &f, sizeof(w));
+  return w;
 }
 
-static sgpt_tensor* sgpt_new_tensor_impl(sgpt_context* ctx, sgpt_type type,
-                                         int n_dims, const int64_t* ne,
-                                         void* data) {
-  sgpt_object* obj_cur = ctx->objects_end;
-  const size_t cur_offset = obj_cur == NULL ? 0 : obj_cur->offset;
-  const size_t cur_size = obj_cur == NULL ? 0 : obj_cur->size;
-  const size_t cur_end = cur_offset + cur_size;
-  char* const mem_buffer = ctx->mem_buffer;
+// Half precision conversions without hardware support, from the FP16 library
+// by Marat Dukhan. Both round to nearest even and keep NaN and infinities.
+static inline float sgpt_compute_fp16_to_fp32(sgpt_fp16_t h) {
+  const uint32_t w = (uint32_t)h << 16;
+  const uint32_t sign = w & UINT32_C(0x80000000);
+  const uint32_t two_w = w + w;
+  const uint32_t exp_offset = UINT32_C(0xe0) << 23;
+  const float exp_scale = 0x1.0p-112f;
+  const float normalized_value =
+      sgpt_fp32_from_bits((two_w >> 4) + exp_offset) * exp_scale;
+  const uint32_t magic_mask = UINT32_C(126) << 23;
+  const float magic_bias = 0.5f;
+  const float denormalized_value =
+      sgpt_fp32_from_bits((two_w >> 17) | magic_mask) - magic_bias;
+  const uint32_t denormalized_cutoff = UINT32_C(1) << 27;
+  const uint32_t result =
+      sign | (two_w < denormalized_cutoff
+                  ? sgpt_fp32_to_bits(denormalized_value)
+                  : sgpt_fp32_to_bits(normalized_value));
+  return sgpt_fp32_from_bits(result);
+}
 
-  size_t size_needed = 0;
-  if (data == NULL) {
-    size_needed += SGPT_TYPE_SIZE[type];
-    for (int i = 0; i < n_dims; i++) {
-      size_needed *= ne[i];
-    }
+static inline sgpt_fp16_t sgpt_compute_fp32_to_fp16(float f) {
+  const float scale_to_inf = 0x1.0p+112f;
+  const float scale_to_zero = 0x1.0p-110f;
+  const uint32_t w = sgpt_fp32_to_bits(f);
+  const float abs_f = sgpt_fp32_from_bits(w & UINT32_C(0x7fffffff));
+  float base = (abs_f * scale_to_inf) * scale_to_zero;
+  const uint32_t shl1_w = w + w;
+  const uint32_t sign = w & UINT32_C(0x80000000);
+  uint32_t bias = shl1_w & UINT32_C(0xff000000);
+  if (bias < UINT32_C(0x71000000)) bias = UINT32_C(0x71000000);
+  base = sgpt_fp32_from_bits((bias >> 1) + UINT32_C(0x07800000)) + base;
+  const uint32_t bits = sgpt_fp32_to_bits(base);
+  const uint32_t exp_bits = (bits >> 13) & UINT32_C(0x00007c00);
+  const uint32_t mantissa_bits = bits & UINT32_C(0x00000fff);
+  const uint32_t nonsign = exp_bits + mantissa_bits;
+  return (sgpt_fp16_t)((sign >> 16) |
+                       (shl1_w > UINT32_C(0xff000000) ? 0x7e00 : nonsign));
+}
+
+static inline float sgpt_compute_bf16_to_fp32(sgpt_bf16_t h) {
+  return sgpt_fp32_from_bits((uint32_t)h << 16);
+}
+
+// Rounds to nearest even, NaN stay quiet NaN.
+static inline sgpt_bf16_t sgpt_compute_fp32_to_bf16(float f) {
+  const uint32_t w = sgpt_fp32_to_bits(f);
+  if ((w & UINT32_C(0x7fffffff)) > UINT32_C(0x7f800000)) {
+    return (sgpt_bf16_t)((w >> 16) | 64);
   }
-  size_needed += sizeof(sgpt_tensor);
-  assert(cur_end + sizeof(sgpt_object) + size_needed <= ctx->mem_size);
+  return (sgpt_bf16_t)((w + (UINT32_C(0x7fff) + ((w >> 16) & 1))) >> 16);
+}
 
-  sgpt_object* const obj_new = (sgpt_object*)(mem_buffer + cur_end);
-  *obj_new = (sgpt_object){
-      .offset = cur_end + sizeof(sgpt_object),
-      .size = size_needed,
-      .next = NULL,
-  };
-  if (obj_cur == NULL) {
-    ctx->objects_begin = obj_new;
-  } else {
-    obj_cur->next = obj_new;
+// Block quantized types store SGPT_QK values as small integers sharing one
+// f16 scale d, the value of a quant q being d q.
+typedef struct sgpt_block_q8_0 {
+  sgpt_fp16_t d;
+  int8_t qs[SGPT_QK];
+} sgpt_block_q8_0;
+static_assert(sizeof(sgpt_block_q8_0) == 2 + SGPT_QK, "wrong q8_0 size");
+
+// Quants are offset by 8 and packed two per byte, value j in the low nibble
+// of qs[j] and value j + SGPT_QK / 2 in the high one.
+typedef struct sgpt_block_q4_0 {
+  sgpt_fp16_t d;
+  uint8_t qs[SGPT_QK / 2];
+} sgpt_block_q4_0;
+static_assert(sizeof(sgpt_block_q4_0) == 2 + SGPT_QK / 2, "wrong q4_0 size");
+
+// Rounds to the nearest integer, ties to even, for |f| < 2^22.
+static inline int sgpt_nearest_int(float f) {
+  const float v = f + 12582912.0f;
+  int32_t i;
+  memcpy(&i, &v, sizeof(i));
+  return (i & 0x007fffff) - 0x00400000;
+}
+
+static void sgpt_quantize_q8_0_scalar(int64_t n, void* z, const float* x) {
+  assert(n % SGPT_QK == 0);
+  sgpt_block_q8_0* const y = z;
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const float* const xb = x + i * SGPT_QK;
+    float amax = 0.0f;
+    for (int j = 0; j < SGPT_QK; j++) {
+      const float v = xb[j] < 0.0f ? -xb[j] : xb[j];
+      amax = v > amax ? v : amax;
+    }
+    const float d = amax / 127.0f;
+    const float id = d != 0.0f ? 1.0f / d : 0.0f;
+    y[i].d = sgpt_compute_fp32_to_fp16(d);
+    for (int j = 0; j < SGPT_QK; j++) {
+      y[i].qs[j] = (int8_t)sgpt_nearest_int(xb[j] * id);
+    }
   }
-  ctx->objects_end = obj_new;
+}
 
-  sgpt_tensor* const result = (sgpt_tensor*)(mem_buffer + obj_new->offset);
-  *result = (sgpt_tensor){
-      .type = type,
-      .n_dims = n_dims,
-      .ne = {1, 1, 1, 1},  // placeholder
-      .nb = {0, 0, 0, 0},  // placeholder
-      .op = SGPT_OP_NONE,
-      .src0 = NULL,
-      .src1 = NULL,
-      .data = data == NULL ? (void*)(result + 1) : data,
-  };
-  for (int i = 0; i < n_dims; i++) result->ne[i] = ne[i];
-  result->nb[0] = SGPT_TYPE_SIZE[type];
-  result->nb[1] = result->nb[0] * result->ne[0];
-  result->nb[2] = result->nb[1] * result->ne[1];
-  result->nb[3] = result->nb[2] * result->ne[2];
+static void sgpt_dequantize_q8_0_scalar(int64_t n, float* z, const void* x) {
+  assert(n % SGPT_QK == 0);
+  const sgpt_block_q8_0* const xb = x;
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const float d = sgpt_compute_fp16_to_fp32(xb[i].d);
+    for (int j = 0; j < SGPT_QK; j++) z[i * SGPT_QK + j] = d * xb[i].qs[j];
+  }
+}
 
-  ctx->n_objects++;
+// The value of largest magnitude maps to -8, so that its sign decides which
+// end of [-8, 7] is used.
+static void sgpt_quantize_q4_0_scalar(int64_t n, void* z, const float* x) {
+  assert(n % SGPT_QK == 0);
+  sgpt_block_q4_0* const y = z;
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const float* const xb = x + i * SGPT_QK;
+    float amax = 0.0f;
+    float max = 0.0f;
+    for (int j = 0; j < SGPT_QK; j++) {
+      const float v = xb[j] < 0.0f ? -xb[j] : xb[j];
+      if (v > amax) {
+        amax = v;
+        max = xb[j];
+      }
+    }
+    const float d = max / -8.0f;
+    const float id = d != 0.0f ? 1.0f / d : 0.0f;
+    y[i].d = sgpt_compute_fp32_to_fp16(d);
+    for (int j = 0; j < SGPT_QK / 2; j++) {
+      const int q0 = SGPT_MIN(15, (int)(xb[j] * id + 8.5f));
+      const int q1 = SGPT_MIN(15, (int)(xb[j + SGPT_QK / 2] * id + 8.5f));
+      y[i].qs[j] = (uint8_t)(q0 | (q1 << 4));
+    }
+  }
+}
 
-  return result;
+static void sgpt_dequantize_q4_0_scalar(int64_t n, float* z, const void* x) {
+  assert(n % SGPT_QK == 0);
+  const sgpt_block_q4_0* const xb = x;
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const float d = sgpt_compute_fp16_to_fp32(xb[i].d);
+    float* const zb = z + i * SGPT_QK;
+    for (int j = 0; j < SGPT_QK / 2; j++) {
+      zb[j] = d * ((xb[i].qs[j] & 0x0f) - 8);
+      zb[j + SGPT_QK / 2] = d * ((xb[i].qs[j] >> 4) - 8);
+    }
+  }
 }
 
-static sgpt_tensor* sgpt_new_tensor(sgpt_context* ctx, sgpt_type type,
-                                    int n_dims, const int64_t* ne) {
-  return sgpt_new_tensor_impl(ctx, type, n_dims, ne, NULL);
+// Row kernels. They work on n contiguous elements, z may alias x or y.
+typedef void (*sgpt_vec_add_f32_t)(int64_t n, float* z, const float* x,
+                                   const float* y);
+typedef void (*sgpt_vec_add_i32_t)(int64_t n, int32_t* z, const int32_t* x,
+                                   const int32_t* y);
+// Transposes a block of 4 byte elements: x has nr rows of nc elements, ldx
+// bytes apart, and z receives nc rows of nr elements, ldz bytes apart.
+typedef void (*sgpt_vec_transpose32_t)(int64_t nr, int64_t nc, void* z,
+                                       size_t ldz, const void* x, size_t ldx);
+// Conversions of n contiguous elements of a type from and to f32.
+typedef void (*sgpt_vec_to_f32_t)(int64_t n, float* z, const void* x);
+typedef void (*sgpt_vec_from_f32_t)(int64_t n, void* z, const float* x);
+// z = x + v, for a src1 broadcast along rows
+typedef void (*sgpt_vec_add1_f32_t)(int64_t n, float* z, const float* x,
+                                    float v);
+typedef void (*sgpt_vec_add1_i32_t)(int64_t n, int32_t* z, const int32_t* x,
+                                    int32_t v);
+
+static void sgpt_vec_add_f32_scalar(int64_t n, float* z, const float* x,
+                                    const float* y) {
+  for (int64_t i = 0; i < n; i++) z[i] = x[i] + y[i];
 }
 
-sgpt_tensor* sgpt_new_tensor_1d(sgpt_context* ctx, sgpt_type type,
-                                int64_t ne0) {
-  return sgpt_new_tensor(ctx, type, 1, &ne0);
+static void sgpt_vec_add_i32_scalar(int64_t n, int32_t* z, const int32_t* x,
+                                    const int32_t* y) {
+  for (int64_t i = 0; i < n; i++) z[i] = x[i] + y[i];
 }
 
-sgpt_tensor* sgpt_new_tensor_2d(sgpt_context* ctx, sgpt_type type, int64_t ne0,
-                                int64_t ne1) {
-  const int64_t ne[2] = {ne0, ne1};
-  return sgpt_new_tensor(ctx, type, 2, ne);
+static void sgpt_vec_add1_f32_scalar(int64_t n, float* z, const float* x,
+                                     float v) {
+  for (int64_t i = 0; i < n; i++) z[i] = x[i] + v;
 }
 
-sgpt_tensor* sgpt_new_tensor_3d(sgpt_context* ctx, sgpt_type type, int64_t ne0,
-                                int64_t ne1, int64_t ne2) {
-  const int64_t ne[3] = {ne0, ne1, ne2};
-  return sgpt_new_tensor(ctx, type, 3, ne);
+static void sgpt_vec_add1_i32_scalar(int64_t n, int32_t* z, const int32_t* x,
+                                     int32_t v) {
+  for (int64_t i = 0; i < n; i++) z[i] = x[i] + v;
 }
 
-sgpt_tensor* sgpt_new_tensor_4d(sgpt_context* ctx, sgpt_type type, int64_t ne0,
-                                int64_t ne1, int64_t ne2, int64_t ne3) {
-  const int64_t ne[4] = {ne0, ne1, ne2, ne3};
-  return sgpt_new_tensor(ctx, type, 4, ne);
+static void sgpt_vec_copy_f32(int64_t n, float* z, const void* x) {
+  memcpy(z, x, sizeof(float) * n);
 }
 
-sgpt_tensor* sgpt_dup_tensor(sgpt_context* ctx, const sgpt_tensor* src) {
-  return sgpt_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL);
+static void sgpt_vec_copy_to_f32(int64_t n, void* z, const float* x) {
+  memcpy(z, x, sizeof(float) * n);
 }
 
-sgpt_tensor* sgpt_view_tensor(sgpt_context* ctx, const sgpt_tensor* src) {
-  return sgpt_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, src->data);
+static void sgpt_vec_i32_to_f32_scalar(int64_t n, float* z, const void* x) {
+  const int32_t* const v = x;
+  for (int64_t i = 0; i < n; i++) z[i] = (float)v[i];
 }
 
-int32_t sgpt_get_i32(const sgpt_tensor* tensor, int n_dims, const int* idxs) {
-  assert(tensor->type == SGPT_TYPE_I32);
-  int loc = 0;
-  for (int i = 0; i < n_dims; i++) {
-    assert(idxs[i] <= tensor->ne[i]);
-    loc += idxs[i] * tensor->nb[i];
-  }
-  return ((int32_t*)(tensor->data + loc))[0];
+// Truncates toward zero like a C cast.
+static void sgpt_vec_f32_to_i32_scalar(int64_t n, void* z, const float* x) {
+  int32_t* const v = z;
+  for (int64_t i = 0; i < n; i++) v[i] = (int32_t)x[i];
 }
 
-int32_t sgpt_get_i32_1d(const sgpt_tensor* tensor, int i0) {
-  return sgpt_get_i32(tensor, 1, &i0);
+static void sgpt_vec_f16_to_f32_scalar(int64_t n, float* z, const void* x) {
+  const sgpt_fp16_t* const h = x;
+  for (int64_t i = 0; i < n; i++) z[i] = sgpt_compute_fp16_to_fp32(h[i]);
 }
 
-int32_t sgpt_get_i32_2d(const sgpt_tensor* tensor, int i0, int i1) {
-  const int idxs[2] = {i0, i1};
-  return sgpt_get_i32(tensor, 2, idxs);
+static void sgpt_vec_f32_to_f16_scalar(int64_t n, void* z, const float* x) {
+  sgpt_fp16_t* const h = z;
+  for (int64_t i = 0; i < n; i++) h[i] = sgpt_compute_fp32_to_fp16(x[i]);
 }
 
-int32_t sgpt_get_i32_3d(const sgpt_tensor* tensor, int i0, int i1, int i2) {
-  const int idxs[3] = {i0, i1, i2};
-  return sgpt_get_i32(tensor, 3, idxs);
+static void sgpt_vec_bf16_to_f32_scalar(int64_t n, float* z, const void* x) {
+  const sgpt_bf16_t* const h = x;
+  for (int64_t i = 0; i < n; i++) z[i] = sgpt_compute_bf16_to_fp32(h[i]);
 }
 
-int32_t sgpt_get_i32_4d(const sgpt_tensor* tensor, int i0, int i1, int i2,
-                        int i3) {
-  const int idxs[4] = {i0, i1, i2, i3};
-  return sgpt_get_i32(tensor, 4, idxs);
+static void sgpt_vec_f32_to_bf16_scalar(int64_t n, void* z, const float* x) {
+  sgpt_bf16_t* const h = z;
+  for (int64_t i = 0; i < n; i++) h[i] = sgpt_compute_fp32_to_bf16(x[i]);
 }
 
-void sgpt_set_i32(const sgpt_tensor* tensor, int n_dims, const int* idxs,
-                  int32_t value) {
-  assert(tensor->type == SGPT_TYPE_I32);
-  int loc = 0;
-  for (int i = 0; i < n_dims; i++) {
-    assert(idxs[i] <= tensor->ne[i]);
-    loc += idxs[i] * tensor->nb[i];
+static void sgpt_vec_transpose32_scalar(int64_t nr, int64_t nc, void* z,
+                                        size_t ldz, const void* x,
+                                        size_t ldx) {
+  for (int64_t j = 0; j < nc; j++) {
+    uint32_t* const zj = (uint32_t*)((char*)z + ldz * j);
+    for (int64_t i = 0; i < nr; i++) {
+      zj[i] = ((const uint32_t*)((const char*)x + ldx * i))[j];
+    }
   }
-  ((int32_t*)(tensor->data + loc))[0] = value;
 }
 
-void sgpt_set_i32_1d(sgpt_tensor* tensor, int i0, int32_t value) {
-  return sgpt_set_i32(tensor, 1, &i0, value);
+#if defined(SGPT_X86)
+__attribute__((target("avx2"))) static void sgpt_vec_add_f32_avx2(
+    int64_t n, float* z, const float* x, const float* y) {
+  int64_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256 z0 = _mm256_add_ps(_mm256_loadu_ps(x + i),
+                                    _mm256_loadu_ps(y + i));
+    const __m256 z1 = _mm256_add_ps(_mm256_loadu_ps(x + i + 8),
+                                    _mm256_loadu_ps(y + i + 8));
+    const __m256 z2 = _mm256_add_ps(_mm256_loadu_ps(x + i + 16),
+                                    _mm256_loadu_ps(y + i + 16));
+    const __m256 z3 = _mm256_add_ps(_mm256_loadu_ps(x + i + 24),
+                                    _mm256_loadu_ps(y + i + 24));
+    _mm256_storeu_ps(z + i, z0);
+    _mm256_storeu_ps(z + i + 8, z1);
+    _mm256_storeu_ps(z + i + 16, z2);
+    _mm256_storeu_ps(z + i + 24, z3);
+  }
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(z + i, _mm256_add_ps(_mm256_loadu_ps(x + i),
+                                          _mm256_loadu_ps(y + i)));
+  }
+  for (; i < n; i++) z[i] = x[i] + y[i];
 }
 
-void sgpt_set_i32_2d(sgpt_tensor* tensor, int i0, int i1, int32_t value) {
-  const int idxs[2] = {i0, i1};
-  return sgpt_set_i32(tensor, 2, idxs, value);
+__attribute__((target("avx2"))) static void sgpt_vec_add_i32_avx2(
+    int64_t n, int32_t* z, const int32_t* x, const int32_t* y) {
+  int64_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    for (int j = 0; j < 32; j += 8) {
+      const __m256i xv = _mm256_loadu_si256((const __m256i*)(x + i + j));
+      const __m256i yv = _mm256_loadu_si256((const __m256i*)(y + i + j));
+      _mm256_storeu_si256((__m256i*)(z + i + j), _mm256_add_epi32(xv, yv));
+    }
+  }
+  for (; i + 8 <= n; i += 8) {
+    const __m256i xv = _mm256_loadu_si256((const __m256i*)(x + i));
+    const __m256i yv = _mm256_loadu_si256((const __m256i*)(y + i));
+    _mm256_storeu_si256((__m256i*)(z + i), _mm256_add_epi32(xv, yv));
+  }
+  for (; i < n; i++) z[i] = x[i] + y[i];
 }
 
-void sgpt_set_i32_3d(sgpt_tensor* tensor, int i0, int i1, int i2,
-                     int32_t value) {
-  const int idxs[3] = {i0, i1, i2};
-  return sgpt_set_i32(tensor, 3, idxs, value);
+__attribute__((target("avx512f"))) static void sgpt_vec_add_f32_avx512(
+    int64_t n, float* z, const float* x, const float* y) {
+  int64_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    const __m512 z0 = _mm512_add_ps(_mm512_loadu_ps(x + i),
+                                    _mm512_loadu_ps(y + i));
+    const __m512 z1 = _mm512_add_ps(_mm512_loadu_ps(x + i + 16),
+                                    _mm512_loadu_ps(y + i + 16));
+    const __m512 z2 = _mm512_add_ps(_mm512_loadu_ps(x + i + 32),
+                                    _mm512_loadu_ps(y + i + 32));
+    const __m512 z3 = _mm512_add_ps(_mm512_loadu_ps(x + i + 48),
+                                    _mm512_loadu_ps(y + i + 48));
+    _mm512_storeu_ps(z + i, z0);
+    _mm512_storeu_ps(z + i + 16, z1);
+    _mm512_storeu_ps(z + i + 32, z2);
+    _mm512_storeu_ps(z + i + 48, z3);
+  }
+  // masked loads and stores handle the tail without a scalar loop
+  for (; i < n; i += 16) {
+    const __mmask16 m =
+        n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+    const __m512 zv = _mm512_add_ps(_mm512_maskz_loadu_ps(m, x + i),
+                                    _mm512_maskz_loadu_ps(m, y + i));
+    _mm512_mask_storeu_ps(z + i, m, zv);
+  }
 }
 
-void sgpt_set_i32_4d(sgpt_tensor* tensor, int i0, int i1, int i2, int i3,
-                     int32_t value) {
-  const int idxs[4] = {i0, i1, i2, i3};
-  return sgpt_set_i32(tensor, 4, idxs, value);
+__attribute__((target("avx512f"))) static void sgpt_vec_add_i32_avx512(
+    int64_t n, int32_t* z, const int32_t* x, const int32_t* y) {
+  int64_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    for (int j = 0; j < 64; j += 16) {
+      const __m512i xv = _mm512_loadu_si512(x + i + j);
+      const __m512i yv = _mm512_loadu_si512(y + i + j);
+      _mm512_storeu_si512(z + i + j, _mm512_add_epi32(xv, yv));
+    }
+  }
+  for (; i < n; i += 16) {
+    const __mmask16 m =
+        n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+    const __m512i zv = _mm512_add_epi32(_mm512_maskz_loadu_epi32(m, x + i),
+                                        _mm512_maskz_loadu_epi32(m, y + i));
+    _mm512_mask_storeu_epi32(z + i, m, zv);
+  }
 }
 
-static sgpt_tensor* sgpt_dup_impl(sgpt_context* ctx, sgpt_tensor* a,
-                                  bool inplace) {
-  sgpt_tensor* result =
-      inplace ? sgpt_view_tensor(ctx, a) : sgpt_dup_tensor(ctx, a);
-  result->op = SGPT_OP_DUP;
-  result->src0 = a;
-  result->src1 = NULL;
-  return result;
+__attribute__((target("avx2"))) static void sgpt_vec_add1_f32_avx2(
+    int64_t n, float* z, const float* x, float v) {
+  const __m256 vv = _mm256_set1_ps(v);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(z + i, _mm256_add_ps(_mm256_loadu_ps(x + i), vv));
+  }
+  for (; i < n; i++) z[i] = x[i] + v;
 }
 
-sgpt_tensor* sgpt_dup(sgpt_context* ctx, sgpt_tensor* a) {
-  return sgpt_dup_impl(ctx, a, false);
+__attribute__((target("avx2"))) static void sgpt_vec_add1_i32_avx2(
+    int64_t n, int32_t* z, const int32_t* x, int32_t v) {
+  const __m256i vv = _mm256_set1_epi32(v);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i xv = _mm256_loadu_si256((const __m256i*)(x + i));
+    _mm256_storeu_si256((__m256i*)(z + i), _mm256_add_epi32(xv, vv));
+  }
+  for (; i < n; i++) z[i] = x[i] + v;
 }
 
-sgpt_tensor* sgpt_dup_inplace(sgpt_context* ctx, sgpt_tensor* a) {
-  return sgpt_dup_impl(ctx, a, true);
+__attribute__((target("avx512f"))) static void sgpt_vec_add1_f32_avx512(
+    int64_t n, float* z, const float* x, float v) {
+  const __m512 vv = _mm512_set1_ps(v);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 m =
+        n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(z + i, m,
+                          _mm512_add_ps(_mm512_maskz_loadu_ps(m, x + i), vv));
+  }
 }
 
-static sgpt_tensor* sgpt_add_impl(sgpt_context* ctx, sgpt_tensor* a,
-                                  sgpt_tensor* b, bool inplace) {
-  assert(sgpt_are_same_shape(a, b));
-  sgpt_tensor* result =
-      inplace ? sgpt_view_tensor(ctx, a) : sgpt_dup_tensor(ctx, a);
-  result->op = SGPT_OP_ADD;
-  result->src0 = a;
-  result->src1 = b;
-  return result;
+__attribute__((target("avx512f"))) static void sgpt_vec_add1_i32_avx512(
+    int64_t n, int32_t* z, const int32_t* x, int32_t v) {
+  const __m512i vv = _mm512_set1_epi32(v);
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 m =
+        n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+    const __m512i xv = _mm512_maskz_loadu_epi32(m, x + i);
+    _mm512_mask_storeu_epi32(z + i, m, _mm512_add_epi32(xv, vv));
+  }
 }
 
-sgpt_tensor* sgpt_add(sgpt_context* ctx, sgpt_tensor* a, sgpt_tensor* b) {
-  return sgpt_add_impl(ctx, a, b, false);
+__attribute__((target("avx2"))) static void sgpt_vec_i32_to_f32_avx2(
+    int64_t n, float* z, const void* x) {
+  const int32_t* const v = x;
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i q = _mm256_loadu_si256((const __m256i*)(v + i));
+    _mm256_storeu_ps(z + i, _mm256_cvtepi32_ps(q));
+  }
+  for (; i < n; i++) z[i] = (float)v[i];
 }
 
-sgpt_tensor* sgpt_add_inplace(sgpt_context* ctx, sgpt_tensor* a,
-                              sgpt_tensor* b) {
-  return sgpt_add_impl(ctx, a, b, true);
+__attribute__((target("avx2"))) static void sgpt_vec_f32_to_i32_avx2(
+    int64_t n, void* z, const float* x) {
+  int32_t* const v = z;
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_si256((__m256i*)(v + i),
+                        _mm256_cvttps_epi32(_mm256_loadu_ps(x + i)));
+  }
+  for (; i < n; i++) v[i] = (int32_t)x[i];
 }
 
-static void sgpt_visit_parents(sgpt_cgraph* cgraph, sgpt_tensor* node) {
-  for (int i = 0; i < cgraph->n_nodes; i++) {
-    if (cgraph->nodes[i] == node) return;
+__attribute__((target("avx512f"))) static void sgpt_vec_i32_to_f32_avx512(
+    int64_t n, float* z, const void* x) {
+  const int32_t* const v = x;
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 m =
+        n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_ps(
+        z + i, m, _mm512_cvtepi32_ps(_mm512_maskz_loadu_epi32(m, v + i)));
   }
-  for (int i = 0; i < cgraph->n_leafs; i++) {
-    if (cgraph->leafs[i] == node) return;
+}
+
+__attribute__((target("avx512f"))) static void sgpt_vec_f32_to_i32_avx512(
+    int64_t n, void* z, const float* x) {
+  int32_t* const v = z;
+  for (int64_t i = 0; i < n; i += 16) {
+    const __mmask16 m =
+        n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+    _mm512_mask_storeu_epi32(
+        v + i, m, _mm512_cvttps_epi32(_mm512_maskz_loadu_ps(m, x + i)));
   }
-  if (node->src0) sgpt_visit_parents(cgraph, node->src0);
-  if (node->src1) sgpt_visit_parents(cgraph, node->src1);
-  if (node->op == SGPT_OP_NONE) {
-    assert(cgraph->n_leafs < SGPT_MAX_NODES);
-    cgraph->leafs[cgraph->n_leafs] = node;
-    cgraph->n_leafs++;
-  } else {
-    assert(cgraph->n_nodes < SGPT_MAX_NODES);
-    cgraph->nodes[cgraph->n_nodes] = node;
-    cgraph->n_nodes++;
+}
+
+__attribute__((target("avx2,f16c"))) static void sgpt_vec_f16_to_f32_f16c(
+    int64_t n, float* z, const void* x) {
+  const sgpt_fp16_t* const h = x;
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(z + i,
+                     _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h + i))));
   }
+  for (; i < n; i++) z[i] = sgpt_compute_fp16_to_fp32(h[i]);
 }
 
-sgpt_cgraph sgpt_build_forward(sgpt_tensor* tensor) {
-  sgpt_cgraph result = {
-      .n_nodes = 0,
-      .n_leafs = 0,
-      .nodes = {NULL},
-      .leafs = {NULL},
-  };
-  sgpt_visit_parents(&result, tensor);
-  if (result.n_nodes > 0) assert(result.nodes[result.n_nodes - 1] == tensor);
-  return result;
+__attribute__((target("avx2,f16c"))) static void sgpt_vec_f32_to_f16_f16c(
+    int64_t n, void* z, const float* x) {
+  sgpt_fp16_t* const h = z;
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m128i v =
+        _mm256_cvtps_ph(_mm256_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i*)(h + i), v);
+  }
+  for (; i < n; i++) h[i] = sgpt_compute_fp32_to_fp16(x[i]);
 }
 
-static void sgpt_compute_forward_dup_f32(sgpt_tensor* src0, sgpt_tensor* dst) {
-  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
-  assert(src0->ne[0] == dst->ne[0]);
-  assert(src0->ne[1] == dst->ne[1]);
-  assert(src0->ne[2] == dst->ne[2]);
-  assert(src0->ne[3] == dst->ne[3]);
-  for (int i3 = 0; i3 < src0->ne[3]; i3++) {
-    size_t loc3 = src0->nb[3] * i3;
-    for (int i2 = 0; i2 < src0->ne[2]; i2++) {
-      size_t loc2 = loc3 + src0->nb[2] * i2;
-      for (int i1 = 0; i1 < src0->ne[1]; i1++) {
-        size_t loc1 = loc2 + src0->nb[1] * i1;
-        for (int i0 = 0; i0 < src0->ne[0]; i0++) {
-          size_t loc0 = loc1 + src0->nb[0] * i0;
-          ((float*)(dst->data + loc0))[0] = ((float*)(src0->data + loc0))[0];
-        }
-      }
-    }
+__attribute__((target("avx2"))) static void sgpt_vec_bf16_to_f32_avx2(
+    int64_t n, float* z, const void* x) {
+  const sgpt_bf16_t* const h = x;
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i v =
+        _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(h + i)));
+    _mm256_storeu_si256((__m256i*)(z + i), _mm256_slli_epi32(v, 16));
   }
+  for (; i < n; i++) z[i] = sgpt_compute_bf16_to_fp32(h[i]);
 }
 
-static void sgpt_compute_forward_dup_i32(sgpt_tensor* src0, sgpt_tensor* dst) {
-  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
-  assert(src0->ne[0] == dst->ne[0]);
-  assert(src0->ne[1] == dst->ne[1]);
-  assert(src0->ne[2] == dst->ne[2]);
-  assert(src0->ne[3] == dst->ne[3]);
-  for (int i3 = 0; i3 < src0->ne[3]; i3++) {
-    size_t loc3 = src0->nb[3] * i3;
-    for (int i2 = 0; i2 < src0->ne[2]; i2++) {
-      size_t loc2 = loc3 + src0->nb[2] * i2;
-      for (int i1 = 0; i1 < src0->ne[1]; i1++) {
-        size_t loc1 = loc2 + src0->nb[1] * i1;
-        for (int i0 = 0; i0 < src0->ne[0]; i0++) {
-          size_t loc0 = loc1 + src0->nb[0] * i0;
-          ((int32_t*)(dst->data + loc0))[0] =
-              ((int32_t*)(src0->data + loc0))[0];
-        }
-      }
-    }
+// The integer form of sgpt_compute_fp32_to_bf16, eight values at a time.
+__attribute__((target("avx2"))) static void sgpt_vec_f32_to_bf16_avx2(
+    int64_t n, void* z, const float* x) {
+  sgpt_bf16_t* const h = z;
+  const __m256i abs_mask = _mm256_set1_epi32(0x7fffffff);
+  const __m256i inf = _mm256_set1_epi32(0x7f800000);
+  const __m256i round = _mm256_set1_epi32(0x7fff);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i quiet = _mm256_set1_epi32(64);
+  int64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i w = _mm256_loadu_si256((const __m256i*)(x + i));
+    const __m256i hi = _mm256_srli_epi32(w, 16);
+    const __m256i rounded = _mm256_srli_epi32(
+        _mm256_add_epi32(w, _mm256_add_epi32(round, _mm256_and_si256(hi, one))),
+        16);
+    const __m256i nan =
+        _mm256_cmpgt_epi32(_mm256_and_si256(w, abs_mask), inf);
+    const __m256i v = _mm256_blendv_epi8(rounded, _mm256_or_si256(hi, quiet),
+                                         nan);
+    // pack within 128 bit lanes, then gather the two low quarters
+    const __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(v, v), 0x08);
+    _mm_storeu_si128((__m128i*)(h + i), _mm256_castsi256_si128(packed));
   }
+  for (; i < n; i++) h[i] = sgpt_compute_fp32_to_bf16(x[i]);
 }
 
-static void sgpt_compute_forward_dup(sgpt_tensor* src0, sgpt_tensor* dst) {
-  assert(src0->type == dst->type);
-  switch (src0->type) {
-    case SGPT_TYPE_F32:
-      sgpt_compute_forward_dup_f32(src0, dst);
-      break;
-    case SGPT_TYPE_I32:
-      sgpt_compute_forward_dup_i32(src0, dst);
-      break;
-    default:
-      assert(false);
+__attribute__((target("avx512f"))) static void sgpt_vec_f16_to_f32_avx512(
+    int64_t n, float* z, const void* x) {
+  const sgpt_fp16_t* const h = x;
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(
+        z + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(h + i))));
   }
+  for (; i < n; i++) z[i] = sgpt_compute_fp16_to_fp32(h[i]);
 }
 
-static void sgpt_compute_forward_add_f32(sgpt_tensor* src0, sgpt_tensor* src1,
-                                         sgpt_tensor* dst) {
-  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
-  assert(src0->ne[0] == dst->ne[0]);
-  assert(src0->ne[1] == dst->ne[1]);
-  assert(src0->ne[2] == dst->ne[2]);
-  assert(src0->ne[3] == dst->ne[3]);
-  assert(src1->ne[0] == dst->ne[0]);
-  assert(src1->ne[1] == dst->ne[1]);
-  assert(src1->ne[2] == dst->ne[2]);
-  assert(src1->ne[3] == dst->ne[3]);
-  for (int i3 = 0; i3 < src0->ne[3]; i3++) {
-    size_t loc3 = src0->nb[3] * i3;
-    for (int i2 = 0; i2 < src0->ne[2]; i2++) {
-      size_t loc2 = loc3 + src0->nb[2] * i2;
-      for (int i1 = 0; i1 < src0->ne[1]; i1++) {
-        size_t loc1 = loc2 + src0->nb[1] * i1;
-        for (int i0 = 0; i0 < src0->ne[0]; i0++) {
-          size_t loc0 = loc1 + src0->nb[0] * i0;
-          ((float*)(dst->data + loc0))[0] = ((float*)(src0->data + loc0))[0];
-          ((float*)(dst->data + loc0))[0] += ((float*)(src1->data + loc0))[0];
-        }
-      }
-    }
+__attribute__((target("avx512f"))) static void sgpt_vec_f32_to_f16_avx512(
+    int64_t n, void* z, const float* x) {
+  sgpt_fp16_t* const h = z;
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m256i v =
+        _mm512_cvtps_ph(_mm512_loadu_ps(x + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm256_storeu_si256((__m256i*)(h + i), v);
   }
+  for (; i < n; i++) h[i] = sgpt_compute_fp32_to_fp16(x[i]);
 }
 
-static void sgpt_compute_forward_add_i32(sgpt_tensor* src0, sgpt_tensor* src1,
-                                         sgpt_tensor* dst) {
-  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
-  assert(src0->ne[0] == dst->ne[0]);
-  assert(src0->ne[1] == dst->ne[1]);
-  assert(src0->ne[2] == dst->ne[2]);
-  assert(src0->ne[3] == dst->ne[3]);
-  assert(src1->ne[0] == dst->ne[0]);
-  assert(src1->ne[1] == dst->ne[1]);
-  assert(src1->ne[2] == dst->ne[2]);
-  assert(src1->ne[3] == dst->ne[3]);
-  for (int i3 = 0; i3 < src0->ne[3]; i3++) {
-    size_t loc3 = src0->nb[3] * i3;
-    for (int i2 = 0; i2 < src0->ne[2]; i2++) {
-      size_t loc2 = loc3 + src0->nb[2] * i2;
-      for (int i1 = 0; i1 < src0->ne[1]; i1++) {
-        size_t loc1 = loc2 + src0->nb[1] * i1;
-        for (int i0 = 0; i0 < src0->ne[0]; i0++) {
-          size_t loc0 = loc1 + src0->nb[0] * i0;
-          ((int32_t*)(dst->data + loc0))[0] =
-              ((int32_t*)(src0->data + loc0))[0];
-          ((int32_t*)(dst->data + loc0))[0] +=
-              ((int32_t*)(src1->data + loc0))[0];
-        }
-      }
-    }
+__attribute__((target("avx512f"))) static void sgpt_vec_bf16_to_f32_avx512(
+    int64_t n, float* z, const void* x) {
+  const sgpt_bf16_t* const h = x;
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m512i v =
+        _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)(h + i)));
+    _mm512_storeu_si512(z + i, _mm512_slli_epi32(v, 16));
   }
+  for (; i < n; i++) z[i] = sgpt_compute_bf16_to_fp32(h[i]);
 }
 
-static void sgpt_compute_forward_add(sgpt_tensor* src0, sgpt_tensor* src1,
-                                     sgpt_tensor* dst) {
-  assert(src0->type == dst->type);
-  assert(src1->type == dst->type);
-  switch (src0->type) {
-    case SGPT_TYPE_F32:
-      sgpt_compute_forward_add_f32(src0, src1, dst);
-      break;
-    case SGPT_TYPE_I32:
-      sgpt_compute_forward_add_i32(src0, src1, dst);
-      break;
-    default:
-      assert(false);
+// vcvtneps2bf16 rounds to nearest even like the scalar code, but flushes f32
+// denormals to zero.
+__attribute__((target("avx512f,avx512bf16"))) static void
+sgpt_vec_f32_to_bf16_avx512bf16(int64_t n, void* z, const float* x) {
+  sgpt_bf16_t* const h = z;
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m256bh v = _mm512_cvtneps_pbh(_mm512_loadu_ps(x + i));
+    _mm256_storeu_si256((__m256i*)(h + i), (__m256i)v);
   }
+  for (; i < n; i++) h[i] = sgpt_compute_fp32_to_bf16(x[i]);
 }
 
-static void sgpt_compute_forward(sgpt_tensor* tensor) {
-  switch (tensor->op) {
-    case SGPT_OP_DUP:
-      sgpt_compute_forward_dup(tensor->src0, tensor);
-      break;
-    case SGPT_OP_ADD:
-      sgpt_compute_forward_add(tensor->src0, tensor->src1, tensor);
-      break;
-    case SGPT_OP_NONE:
-      break;
-    default:
-      assert(false);
+__attribute__((target("avx2"))) static void sgpt_quantize_q8_0_avx2(
+    int64_t n, void* z, const float* x) {
+  assert(n % SGPT_QK == 0);
+  sgpt_block_q8_0* const y = z;
+  const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+  const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const float* const xb = x + i * SGPT_QK;
+    __m256 v[4];
+    __m256 amax = _mm256_setzero_ps();
+    for (int k = 0; k < 4; k++) {
+      v[k] = _mm256_loadu_ps(xb + 8 * k);
+      amax = _mm256_max_ps(amax, _mm256_andnot_ps(sign_bit, v[k]));
+    }
+    __m128 max4 = _mm_max_ps(_mm256_extractf128_ps(amax, 1),
+                             _mm256_castps256_ps128(amax));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+    const float d = _mm_cvtss_f32(max4) / 127.0f;
+    const float id = d != 0.0f ? 1.0f / d : 0.0f;
+    y[i].d = sgpt_compute_fp32_to_fp16(d);
+    __m256i q[4];
+    for (int k = 0; k < 4; k++) {
+      const __m256 scaled = _mm256_mul_ps(v[k], _mm256_set1_ps(id));
+      q[k] = _mm256_cvtps_epi32(
+          _mm256_round_ps(scaled, _MM_FROUND_TO_NEAREST_INT |
+                                      _MM_FROUND_NO_EXC));
+    }
+    // packing interleaves the 128 bit lanes, the permutation restores order
+    const __m256i q16 = _mm256_packs_epi16(_mm256_packs_epi32(q[0], q[1]),
+                                           _mm256_packs_epi32(q[2], q[3]));
+    _mm256_storeu_si256((__m256i*)y[i].qs,
+                        _mm256_permutevar8x32_epi32(q16, perm));
   }
 }
 
+__attribute__((target("avx2"))) static void sgpt_dequantize_q8_0_avx2(
+    int64_t n, float* z, const void* x) {
+  assert(n % SGPT_QK == 0);
+  const sgpt_block_q8_0* const xb = x;
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const __m256 d = _mm256_set1_ps(sgpt_compute_fp16_to_fp32(xb[i].d));
+    for (int k = 0; k < 4; k++) {
+      const __m256i q = _mm256_cvtepi8_epi32(
+          _mm_loadl_epi64((const __m128i*)(xb[i].qs + 8 * k)));
+      _mm256_storeu_ps(z + i * SGPT_QK + 8 * k,
+                       _mm256_mul_ps(d, _mm256_cvtepi32_ps(q)));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) static void sgpt_quantize_q4_0_avx2(
+    int64_t n, void* z, const float* x) {
+  assert(n % SGPT_QK == 0);
+  sgpt_block_q4_0* const y = z;
+  const __m256 sign_bit = _mm256_set1_ps(-0.0f);
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const float* const xb = x + i * SGPT_QK;
+    __m256 v[4];
+    __m256 amax = _mm256_setzero_ps();
+    for (int k = 0; k < 4; k++) {
+      v[k] = _mm256_loadu_ps(xb + 8 * k);
+      amax = _mm256_max_ps(amax, _mm256_andnot_ps(sign_bit, v[k]));
+    }
+    __m128 max4 = _mm_max_ps(_mm256_extractf128_ps(amax, 1),
+                             _mm256_castps256_ps128(amax));
+    max4 = _mm_max_ps(max4, _mm_movehl_ps(max4, max4));
+    max4 = _mm_max_ss(max4, _mm_movehdup_ps(max4));
+    // like the scalar code, the first value of largest magnitude sets the sign
+    const __m256 amax8 = _mm256_set1_ps(_mm_cvtss_f32(max4));
+    uint32_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+      const __m256 eq = _mm256_cmp_ps(_mm256_andnot_ps(sign_bit, v[k]), amax8,
+                                      _CMP_EQ_OQ);
+      mask |= (uint32_t)_mm256_movemask_ps(eq) << (8 * k);
+    }
+    const float max =
+        _mm_cvtss_f32(max4) != 0.0f ? xb[__builtin_ctz(mask)] : 0.0f;
+    const float d = max / -8.0f;
+    const float id = d != 0.0f ? 1.0f / d : 0.0f;
+    y[i].d = sgpt_compute_fp32_to_fp16(d);
+    __m256i q[4];
+    for (int k = 0; k < 4; k++) {
+      const __m256 shifted = _mm256_add_ps(
+          _mm256_mul_ps(v[k], _mm256_set1_ps(id)), _mm256_set1_ps(8.5f));
+      q[k] = _mm256_min_epi32(_mm256_cvttps_epi32(shifted),
+                              _mm256_set1_epi32(15));
+    }
+    // values 0..15 in the low nibbles, 16..31 in the high ones
+    const __m256i lo = _mm256_permute4x64_epi64(
+        _mm256_packs_epi32(q[0], q[1]), 0xd8);
+    const __m256i hi = _mm256_permute4x64_epi64(
+        _mm256_packs_epi32(q[2], q[3]), 0xd8);
+    const __m256i b16 = _mm256_or_si256(lo, _mm256_slli_epi16(hi, 4));
+    const __m256i b8 =
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(b16, b16), 0x08);
+    _mm_storeu_si128((__m128i*)y[i].qs, _mm256_castsi256_si128(b8));
+  }
+}
+
+__attribute__((target("avx2"))) static void sgpt_dequantize_q4_0_avx2(
+    int64_t n, float* z, const void* x) {
+  assert(n % SGPT_QK == 0);
+  const sgpt_block_q4_0* const xb = x;
+  const __m128i low_nibble = _mm_set1_epi8(0x0f);
+  const __m256i offset = _mm256_set1_epi32(8);
+  for (int64_t i = 0; i < n / SGPT_QK; i++) {
+    const __m256 d = _mm256_set1_ps(sgpt_compute_fp16_to_fp32(xb[i].d));
+    const __m128i qs = _mm_loadu_si128((const __m128i*)xb[i].qs);
+    const __m128i q[2] = {
+        _mm_and_si128(qs, low_nibble),
+        _mm_and_si128(_mm_srli_epi16(qs, 4), low_nibble),
+    };
+    for (int k = 0; k < 4; k++) {
+      const __m128i qk = k % 2 == 0 ? q[k / 2] : _mm_srli_si128(q[k / 2], 8);
+      const __m256i v = _mm256_sub_epi32(_mm256_cvtepu8_epi32(qk), offset);
+      _mm256_storeu_ps(z + i * SGPT_QK + 8 * k,
+                       _mm256_mul_ps(d, _mm256_cvtepi32_ps(v)));
+    }
+  }
+}
+
+// 8x8 blocks are transposed in registers, the edges element by element.
+// Only shuffles touch the values, so the float instructions move any 32 bit
+// data unchanged.
+__attribute__((target("avx2"))) static void sgpt_vec_transpose32_avx2(
+    int64_t nr, int64_t nc, void* z, size_t ldz, const void* x, size_t ldx) {
+  const char* const xb = x;
+  char* const zb = z;
+  const int64_t nr8 = nr / 8 * 8;
+  const int64_t nc8 = nc / 8 * 8;
+  for (int64_t i = 0; i < nr8; i += 8) {
+    for (int64_t j = 0; j < nc8; j += 8) {
+      __m256 r[8];
+      for (int k = 0; k < 8; k++) {
+        r[k] = _mm256_loadu_ps((const float*)(xb + ldx * (i + k)) + j);
+      }
+      __m256 t[8];
+      for (int k = 0; k < 8; k += 2) {
+        t[k] = _mm256_unpacklo_ps(r[k], r[k + 1]);
+        t[k + 1] = _mm256_unpackhi_ps(r[k], r[k + 1]);
+      }
+      __m256 u[8];
+      for (int k = 0; k < 8; k += 4) {
+        u[k] = _mm256_shuffle_ps(t[k], t[k + 2], 0x44);
+        u[k + 1] = _mm256_shuffle_ps(t[k], t[k + 2], 0xee);
+        u[k + 2] = _mm256_shuffle_ps(t[k + 1], t[k + 3], 0x44);
+        u[k + 3] = _mm256_shuffle_ps(t[k + 1], t[k + 3], 0xee);
+      }
+      for (int k = 0; k < 4; k++) {
+        _mm256_storeu_ps((float*)(zb + ldz * (j + k)) + i,
+                         _mm256_permute2f128_ps(u[k], u[k + 4], 0x20));
+        _mm256_storeu_ps((float*)(zb + ldz * (j + k + 4)) + i,
+                         _mm256_permute2f128_ps(u[k], u[k + 4], 0x31));
+      }
+    }
+  }
+  if (nc8 < nc) {
+    sgpt_vec_transpose32_scalar(nr8, nc - nc8, zb + ldz * nc8, ldz,
+                                (const uint32_t*)xb + nc8, ldx);
+  }
+  if (nr8 < nr) {
+    sgpt_vec_transpose32_scalar(nr - nr8, nc, (uint32_t*)zb + nr8, ldz,
+                                xb + ldx * nr8, ldx);
+  }
+}
+#endif
+
+#if defined(__ARM_NEON)
+static void sgpt_vec_add_f32_neon(int64_t n, float* z, const float* x,
+                                  const float* y) {
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const float32x4_t z0 = vaddq_f32(vld1q_f32(x + i), vld1q_f32(y + i));
+    const float32x4_t z1 =
+        vaddq_f32(vld1q_f32(x + i + 4), vld1q_f32(y + i + 4));
+    const float32x4_t z2 =
+        vaddq_f32(vld1q_f32(x + i + 8), vld1q_f32(y + i + 8));
+    const float32x4_t z3 =
+        vaddq_f32(vld1q_f32(x + i + 12), vld1q_f32(y + i + 12));
+    vst1q_f32(z + i, z0);
+    vst1q_f32(z + i + 4, z1);
+    vst1q_f32(z + i + 8, z2);
+    vst1q_f32(z + i + 12, z3);
+  }
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(z + i, vaddq_f32(vld1q_f32(x + i), vld1q_f32(y + i)));
+  }
+  for (; i < n; i++) z[i] = x[i] + y[i];
+}
+
+static void sgpt_vec_add_i32_neon(int64_t n, int32_t* z, const int32_t* x,
+                                  const int32_t* y) {
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_s32(z + i, vaddq_s32(vld1q_s32(x + i), vld1q_s32(y + i)));
+  }
+  for (; i < n; i++) z[i] = x[i] + y[i];
+}
+
+static void sgpt_vec_add1_f32_neon(int64_t n, float* z, const float* x,
+                                   float v) {
+  const float32x4_t vv = vdupq_n_f32(v);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) vst1q_f32(z + i, vaddq_f32(vld1q_f32(x + i), vv));
+  for (; i < n; i++) z[i] = x[i] + v;
+}
+
+static void sgpt_vec_add1_i32_neon(int64_t n, int32_t* z, const int32_t* x,
+                                   int32_t v) {
+  const int32x4_t vv = vdupq_n_s32(v);
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) vst1q_s32(z + i, vaddq_s32(vld1q_s32(x + i), vv));
+  for (; i < n; i++) z[i] = x[i] + v;
+}
+
+static void sgpt_vec_i32_to_f32_neon(int64_t n, float* z, const void* x) {
+  const int32_t* const v = x;
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) vst1q_f32(z + i, vcvtq_f32_s32(vld1q_s32(v + i)));
+  for (; i < n; i++) z[i] = (float)v[i];
+}
+
+static void sgpt_vec_f32_to_i32_neon(int64_t n, void* z, const float* x) {
+  int32_t* const v = z;
+  int64_t i = 0;
+  for (; i + 4 <= n; i += 4) vst1q_s32(v + i, vcvtq_s32_f32(vld1q_f32(x + i)));
+  for (; i < n; i++) v[i] = (int32_t)x[i];
+}
+
+static void sgpt_vec_transpose32_neon(int64_t nr, int64_t nc, void* z,
+                                      size_t ldz, const void* x, size_t ldx) {
+  const char* const xb = x;
+  char* const zb = z;
+  const int64_t nr4 = nr / 4 * 4;
+  const int64_t nc4 = nc / 4 * 4;
+  for (int64_t i = 0; i < nr4; i += 4) {
+    for (int64_t j = 0; j < nc4; j += 4) {
+      uint32x4_t r[4];
+      for (int k = 0; k < 4; k++) {
+        r[k] = vld1q_u32((const uint32_t*)(xb + ldx * (i + k)) + j);
+      }
+      const uint32x4x2_t t01 = vtrnq_u32(r[0], r[1]);
+      const uint32x4x2_t t23 = vtrnq_u32(r[2], r[3]);
+      const uint32x4_t c[4] = {
+          vcombine_u32(vget_low_u32(t01.val[0]), vget_low_u32(t23.val[0])),
+          vcombine_u32(vget_low_u32(t01.val[1]), vget_low_u32(t23.val[1])),
+          vcombine_u32(vget_high_u32(t01.val[0]), vget_high_u32(t23.val[0])),
+          vcombine_u32(vget_high_u32(t01.val[1]), vget_high_u32(t23.val[1])),
+      };
+      for (int k = 0; k < 4; k++) {
+        vst1q_u32((uint32_t*)(zb + ldz * (j + k)) + i, c[k]);
+      }
+    }
+  }
+  if (nc4 < nc) {
+    sgpt_vec_transpose32_scalar(nr4, nc - nc4, zb + ldz * nc4, ldz,
+                                (const uint32_t*)xb + nc4, ldx);
+  }
+  if (nr4 < nr) {
+    sgpt_vec_transpose32_scalar(nr - nr4, nc, (uint32_t*)zb + nr4, ldz,
+                                xb + ldx * nr4, ldx);
+  }
+}
+#endif
+
+static struct {
+  sgpt_vec_add_f32_t add_f32;
+  sgpt_vec_add_i32_t add_i32;
+  sgpt_vec_add1_f32_t add1_f32;
+  sgpt_vec_add1_i32_t add1_i32;
+  sgpt_vec_transpose32_t transpose32;
+  sgpt_vec_to_f32_t to_f32[SGPT_TYPE_COUNT];
+  sgpt_vec_from_f32_t from_f32[SGPT_TYPE_COUNT];
+} sgpt_vec = {
+    .add_f32 = sgpt_vec_add_f32_scalar,
+    .add_i32 = sgpt_vec_add_i32_scalar,
+    .add1_f32 = sgpt_vec_add1_f32_scalar,
+    .add1_i32 = sgpt_vec_add1_i32_scalar,
+    .transpose32 = sgpt_vec_transpose32_scalar,
+    // types without an entry have no conversion to f32
+    .to_f32 =
+        {
+            [SGPT_TYPE_F32] = sgpt_vec_copy_f32,
+            [SGPT_TYPE_I32] = sgpt_vec_i32_to_f32_scalar,
+            [SGPT_TYPE_F16] = sgpt_vec_f16_to_f32_scalar,
+            [SGPT_TYPE_BF16] = sgpt_vec_bf16_to_f32_scalar,
+            [SGPT_TYPE_Q8_0] = sgpt_dequantize_q8_0_scalar,
+            [SGPT_TYPE_Q4_0] = sgpt_dequantize_q4_0_scalar,
+        },
+    .from_f32 =
+        {
+            [SGPT_TYPE_F32] = sgpt_vec_copy_to_f32,
+            [SGPT_TYPE_I32] = sgpt_vec_f32_to_i32_scalar,
+            [SGPT_TYPE_F16] = sgpt_vec_f32_to_f16_scalar,
+            [SGPT_TYPE_BF16] = sgpt_vec_f32_to_bf16_scalar,
+            [SGPT_TYPE_Q8_0] = sgpt_quantize_q8_0_scalar,
+            [SGPT_TYPE_Q4_0] = sgpt_quantize_q4_0_scalar,
+        },
+};
+
+// Picks the widest row kernels the running cpu supports.
+static void sgpt_vec_init(void) {
+#if defined(SGPT_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    sgpt_vec.add_f32 = sgpt_vec_add_f32_avx512;
+    sgpt_vec.add_i32 = sgpt_vec_add_i32_avx512;
+    sgpt_vec.add1_f32 = sgpt_vec_add1_f32_avx512;
+    sgpt_vec.add1_i32 = sgpt_vec_add1_i32_avx512;
+    sgpt_vec.transpose32 = sgpt_vec_transpose32_avx2;
+    sgpt_vec.to_f32[SGPT_TYPE_I32] = sgpt_vec_i32_to_f32_avx512;
+    sgpt_vec.from_f32[SGPT_TYPE_I32] = sgpt_vec_f32_to_i32_avx512;
+    sgpt_vec.to_f32[SGPT_TYPE_F16] = sgpt_vec_f16_to_f32_avx512;
+    sgpt_vec.from_f32[SGPT_TYPE_F16] = sgpt_vec_f32_to_f16_avx512;
+    sgpt_vec.to_f32[SGPT_TYPE_BF16] = sgpt_vec_bf16_to_f32_avx512;
+    sgpt_vec.from_f32[SGPT_TYPE_BF16] = sgpt_vec_f32_to_bf16_avx2;
+  } else if (__builtin_cpu_supports("avx2")) {
+    sgpt_vec.add_f32 = sgpt_vec_add_f32_avx2;
+    sgpt_vec.add_i32 = sgpt_vec_add_i32_avx2;
+    sgpt_vec.add1_f32 = sgpt_vec_add1_f32_avx2;
+    sgpt_vec.add1_i32 = sgpt_vec_add1_i32_avx2;
+    sgpt_vec.transpose32 = sgpt_vec_transpose32_avx2;
+    sgpt_vec.to_f32[SGPT_TYPE_I32] = sgpt_vec_i32_to_f32_avx2;
+    sgpt_vec.from_f32[SGPT_TYPE_I32] = sgpt_vec_f32_to_i32_avx2;
+    sgpt_vec.to_f32[SGPT_TYPE_BF16] = sgpt_vec_bf16_to_f32_avx2;
+    sgpt_vec.from_f32[SGPT_TYPE_BF16] = sgpt_vec_f32_to_bf16_avx2;
+    if (__builtin_cpu_supports("f16c")) {
+      sgpt_vec.to_f32[SGPT_TYPE_F16] = sgpt_vec_f16_to_f32_f16c;
+      sgpt_vec.from_f32[SGPT_TYPE_F16] = sgpt_vec_f32_to_f16_f16c;
+    }
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    sgpt_vec.to_f32[SGPT_TYPE_Q8_0] = sgpt_dequantize_q8_0_avx2;
+    sgpt_vec.from_f32[SGPT_TYPE_Q8_0] = sgpt_quantize_q8_0_avx2;
+    sgpt_vec.to_f32[SGPT_TYPE_Q4_0] = sgpt_dequantize_q4_0_avx2;
+    sgpt_vec.from_f32[SGPT_TYPE_Q4_0] = sgpt_quantize_q4_0_avx2;
+  }
+  if (__builtin_cpu_supports("avx512bf16")) {
+    sgpt_vec.from_f32[SGPT_TYPE_BF16] = sgpt_vec_f32_to_bf16_avx512bf16;
+  }
+#elif defined(__ARM_NEON)
+  sgpt_vec.add_f32 = sgpt_vec_add_f32_neon;
+  sgpt_vec.add_i32 = sgpt_vec_add_i32_neon;
+  sgpt_vec.add1_f32 = sgpt_vec_add1_f32_neon;
+  sgpt_vec.add1_i32 = sgpt_vec_add1_i32_neon;
+  sgpt_vec.transpose32 = sgpt_vec_transpose32_neon;
+  sgpt_vec.to_f32[SGPT_TYPE_I32] = sgpt_vec_i32_to_f32_neon;
+  sgpt_vec.from_f32[SGPT_TYPE_I32] = sgpt_vec_f32_to_i32_neon;
+#endif
+}
+
+static pthread_once_t sgpt_vec_once = PTHREAD_ONCE_INIT;
+
+static void sgpt_threadpool_free(struct sgpt_threadpool* pool);
+
+#define SGPT_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Maps an anonymous buffer of at least size bytes that starts at a multiple
+// of alignment. With hugepages the mapping is trimmed to a huge page boundary
+// so that the kernel can back it with transparent huge pages, and hugepages is
+// cleared when they cannot be asked for. Returns NULL on failure.
+static void* sgpt_mmap_buffer(size_t size, size_t alignment, bool* hugepages,
+                              bool populate, size_t* mapped_size) {
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t page_align = *hugepages ? SGPT_HUGE_PAGE_SIZE : page_size;
+  const size_t align = SGPT_MAX(page_align, alignment);
+  const size_t size_mapped = SGPT_PAD(size, page_align);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_POPULATE)
+  // with hugepages the pages are faulted in after madvise instead
+  if (populate && !*hugepages) flags |= MAP_POPULATE;
+#endif
+  const size_t size_reserved = size_mapped + (align - page_size);
+  char* const base = mmap(NULL, size_reserved, PROT_READ | PROT_WRITE, flags,
+                          -1, 0);
+  if (base == MAP_FAILED) return NULL;
+
+  char* const addr = (char*)SGPT_PAD((uintptr_t)base, align);
+  if (addr > base) munmap(base, addr - base);
+  if (base + size_reserved > addr + size_mapped) {
+    munmap(addr + size_mapped, base + size_reserved - (addr + size_mapped));
+  }
+#if defined(MADV_HUGEPAGE)
+  if (*hugepages && madvise(addr, size_mapped, MADV_HUGEPAGE) != 0) {
+    *hugepages = false;
+  }
+#else
+  *hugepages = false;
+#endif
+  if (populate && page_align > page_size) {
+    for (size_t i = 0; i < size_mapped; i += page_size) addr[i] = 0;
+  }
+  *mapped_size = size_mapped;
+  return addr;
+}
+
+// Allocates the arena of a context created with mem_buffer == NULL.
+static bool sgpt_alloc_buffer(sgpt_context* ctx,
+                              const sgpt_init_params* params) {
+  if (params->mem_hugepages || params->mem_populate || params->mem_lock) {
+    ctx->mem_hugepages = params->mem_hugepages;
+    ctx->mem_buffer =
+        sgpt_mmap_buffer(ctx->mem_size, ctx->data_alignment,
+                         &ctx->mem_hugepages, params->mem_populate,
+                         &ctx->mem_mapped_size);
+    if (ctx->mem_buffer == NULL) return false;
+    // hard limits on locked memory are common, so failing is not fatal
+    ctx->mem_locked = params->mem_lock &&
+                      mlock(ctx->mem_buffer, ctx->mem_mapped_size) == 0;
+  } else {
+    const size_t align = SGPT_MAX(ctx->data_alignment, sizeof(void*));
+    if (posix_memalign(&ctx->mem_buffer, align, ctx->mem_size) != 0) {
+      return false;
+    }
+  }
+  ctx->mem_buffer_owned = true;
+  return true;
+}
+
+static void sgpt_free_buffer(sgpt_context* ctx) {
+  if (!ctx->mem_buffer_owned) return;
+  if (ctx->mem_mapped_size > 0) {
+    munmap(ctx->mem_buffer, ctx->mem_mapped_size);
+  } else {
+    free(ctx->mem_buffer);
+  }
+  ctx->mem_buffer = NULL;
+  ctx->mem_buffer_owned = false;
+}
+
+sgpt_context* sgpt_init(sgpt_init_params params) {
+  pthread_once(&sgpt_vec_once, sgpt_vec_init);
+  const size_t data_alignment = params.data_alignment > 0
+                                    ? params.data_alignment
+                                    : SGPT_DEFAULT_DATA_ALIGNMENT;
+  assert((data_alignment & (data_alignment - 1)) == 0);
+
+  // on the heap rather than in mem_buffer, which the caller may have sized
+  // for its objects only
+  sgpt_context* const ctx = malloc(sizeof(sgpt_context));
+  if (ctx == NULL) return NULL;
+
+  *ctx = (sgpt_context){
+      .mem_size = params.mem_size,
+      .mem_buffer = params.mem_buffer,
+      .n_objects = 0,
+      .objects_begin = NULL,
+      .objects_end = NULL,
+      .n_threads = params.n_threads > 0 ? params.n_threads : 1,
+      .threadpool = NULL,
+      .data_alignment = data_alignment,
+      .mem_buffer_owned = false,
+      .mem_mapped_size = 0,
+      .mem_hugepages = false,
+      .mem_locked = false,
+      .measure = params.measure,
+      .mem_needed = 0,
+      .mappings = NULL,
+      .names = NULL,
+  };
+  if (ctx->mem_buffer == NULL && !sgpt_alloc_buffer(ctx, &params)) {
+    sgpt_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+// An entry of the index of tensor names. hash is the hash of the name of
+// tensor when it was set.
+typedef struct sgpt_name_entry {
+  sgpt_tensor* tensor;
+  uint64_t hash;
+} sgpt_name_entry;
+
+// An open addressing table of the named tensors of a context, with linear
+// probing, and the same entries in the order their names were set so that a
+// rollback removes the newest ones.
+typedef struct sgpt_name_index {
+  size_t size; // a power of two, at least twice n_entries
+  size_t n_entries;
+  sgpt_name_entry* table;
+  sgpt_name_entry* log; // holds size / 2 entries
+} sgpt_name_index;
+
+static void sgpt_name_index_free(sgpt_name_index* index) {
+  if (index == NULL) return;
+  free(index->table);
+  free(index->log);
+  free(index);
+}
+
+// A file mapped by sgpt_load.
+typedef struct sgpt_mapping {
+  void* addr;
+  size_t size;
+  struct sgpt_mapping* next;
+} sgpt_mapping;
+
+void sgpt_free(sgpt_context* ctx) {
+  if (ctx->threadpool != NULL) sgpt_threadpool_free(ctx->threadpool);
+  ctx->threadpool = NULL;
+  sgpt_free_buffer(ctx);
+  sgpt_name_index_free(ctx->names);
+  ctx->names = NULL;
+  while (ctx->mappings != NULL) {
+    sgpt_mapping* const mapping = ctx->mappings;
+    ctx->mappings = mapping->next;
+    munmap(mapping->addr, mapping->size);
+    free(mapping);
+  }
+  free(ctx);
+}
+
+static inline int64_t sgpt_nrows(const sgpt_tensor* tensor) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  return tensor->ne[1] * tensor->ne[2] * tensor->ne[3];
+}
+
+static inline int64_t sgpt_nelements(const sgpt_tensor* tensor) {
+  return tensor->ne[0] * sgpt_nrows(tensor);
+}
+
+// Bytes spanned by the data of the tensor, gaps of strided views included.
+size_t sgpt_nbytes(const sgpt_tensor* tensor) {
+  const int64_t blck_size = SGPT_BLCK_SIZE[tensor->type];
+  // dimension 0 is strided too in permuted views
+  size_t nbytes = SGPT_TYPE_SIZE[tensor->type];
+  int i = 0;
+  if (blck_size > 1) {
+    // a row holds ne[0] / blck_size blocks of nb[0] bytes
+    nbytes = tensor->ne[0] * tensor->nb[0] / blck_size;
+    i = 1;
+  }
+  for (; i < SGPT_MAX_DIMS; i++) {
+    nbytes += (tensor->ne[i] - 1) * tensor->nb[i];
+  }
+  return nbytes;
+}
+
+static inline bool sgpt_is_contiguous(const sgpt_tensor* tensor) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  return tensor->nb[0] == SGPT_TYPE_SIZE[tensor->type] &&
+         tensor->nb[1] ==
+             tensor->nb[0] * tensor->ne[0] / SGPT_BLCK_SIZE[tensor->type] &&
+         tensor->nb[2] == tensor->nb[1] * tensor->ne[1] &&
+         tensor->nb[3] == tensor->nb[2] * tensor->ne[2];
+}
+
+// Sources of a tensor. Fused ops list them in srcs, others use src0 and src1.
+static inline int sgpt_n_srcs(const sgpt_tensor* tensor) {
+  if (tensor->srcs != NULL) return tensor->n_srcs;
+  return (tensor->src0 != NULL) + (tensor->src1 != NULL);
+}
+
+static inline sgpt_tensor* sgpt_get_src(const sgpt_tensor* tensor, int i) {
+  if (tensor->srcs != NULL) return tensor->srcs[i];
+  return i == 0 ? tensor->src0 : tensor->src1;
+}
+
+// Whether b can be broadcast to the shape of a, each of its dimensions being
+// either 1 or the same as in a.
+static inline bool sgpt_can_repeat(const sgpt_tensor* b, const sgpt_tensor* a) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  return (b->ne[0] == 1 || b->ne[0] == a->ne[0]) &&
+         (b->ne[1] == 1 || b->ne[1] == a->ne[1]) &&
+         (b->ne[2] == 1 || b->ne[2] == a->ne[2]) &&
+         (b->ne[3] == 1 || b->ne[3] == a->ne[3]);
+}
+
+static inline bool sgpt_are_same_shape(const sgpt_tensor* a,
+                                       const sgpt_tensor* b) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  return ((a->ne[0] == b->ne[0]) && (a->ne[1] == b->ne[1]) &&
+          (a->ne[2] == b->ne[2]) && (a->ne[3] == b->ne[3]));
+}
+
+// Offset in mem_buffer right after the last object.
+static size_t sgpt_objects_end_offset(const sgpt_context* ctx) {
+  const sgpt_object* obj_cur = ctx->objects_end;
+  const size_t cur_offset = obj_cur == NULL ? 0 : obj_cur->offset;
+  const size_t cur_size = obj_cur == NULL ? 0 : obj_cur->size;
+  return cur_offset + cur_size;
+}
+
+// Appends an object of size bytes to the context and returns it. The size is
+// padded so that the next object header stays aligned.
+static sgpt_object* sgpt_new_object(sgpt_context* ctx, sgpt_object_type type,
+                                    size_t size) {
+  sgpt_object* obj_cur = ctx->objects_end;
+  const size_t cur_end = sgpt_objects_end_offset(ctx);
+  char* const mem_buffer = ctx->mem_buffer;
+
+  const size_t size_needed = SGPT_PAD(size, SGPT_OBJECT_ALIGN);
+  assert(cur_end + sizeof(sgpt_object) + size_needed <= ctx->mem_size);
+
+  sgpt_object* const obj_new = (sgpt_object*)(mem_buffer + cur_end);
+  *obj_new = (sgpt_object){
+      .offset = cur_end + sizeof(sgpt_object),
+      .size = size_needed,
+      .next = NULL,
+      .type = type,
+      .padding = 0,
+  };
+  if (obj_cur == NULL) {
+    ctx->objects_begin = obj_new;
+  } else {
+    obj_cur->next = obj_new;
+  }
+  ctx->objects_end = obj_new;
+
+  ctx->n_objects++;
+  ctx->mem_needed += sizeof(sgpt_object) + size_needed;
+
+  return obj_new;
+}
+
+sgpt_arena_mark sgpt_mark(const sgpt_context* ctx) {
+  return (sgpt_arena_mark){
+      .n_objects = ctx->n_objects,
+      .objects_end = ctx->objects_end,
+      .offset = sgpt_objects_end_offset(ctx),
+      .mem_needed = ctx->mem_needed,
+      .n_names = ctx->names != NULL ? ctx->names->n_entries : 0,
+  };
+}
+
+size_t sgpt_used_mem(const sgpt_context* ctx) { return ctx->mem_needed; }
+
+static void sgpt_name_index_pop(sgpt_name_index* index);
+
+void sgpt_rollback(sgpt_context* ctx, sgpt_arena_mark mark) {
+  assert(mark.n_objects <= ctx->n_objects);
+  assert(mark.offset <= sgpt_objects_end_offset(ctx));
+  if (ctx->names != NULL) {
+    assert(mark.n_names <= ctx->names->n_entries);
+    while (ctx->names->n_entries > mark.n_names) {
+      sgpt_name_index_pop(ctx->names);
+    }
+  }
+  ctx->n_objects = mark.n_objects;
+  ctx->objects_end = mark.objects_end;
+  ctx->mem_needed = mark.mem_needed;
+  if (mark.objects_end == NULL) {
+    ctx->objects_begin = NULL;
+  } else {
+    mark.objects_end->next = NULL;
+  }
+}
+
+// Creates a tensor whose data is, in order of precedence, shared with
+// view_src, the given data, or newly allocated after the tensor. In a measure
+// context the allocation is only counted and data stays NULL.
+static sgpt_tensor* sgpt_new_tensor_impl(sgpt_context* ctx, sgpt_type type,
+                                         int n_dims, const int64_t* ne,
+                                         sgpt_tensor* view_src,
+                                         size_t view_offs, void* data) {
+  // views of views share the data of the tensor that owns it
+  if (view_src != NULL && view_src->view_src != NULL) {
+    view_offs += view_src->view_offs;
+    view_src = view_src->view_src;
+  }
+  const bool alloc = view_src == NULL && data == NULL;
+  assert(ne[0] % SGPT_BLCK_SIZE[type] == 0);
+  size_t data_size = 0;
+  if (alloc) {
+    data_size += SGPT_TYPE_SIZE[type] * (ne[0] / SGPT_BLCK_SIZE[type]);
+    for (int i = 1; i < n_dims; i++) {
+      data_size *= ne[i];
+    }
+  }
+
+  // the data follows the tensor, moved up to the next aligned address. A
+  // measure context assumes an aligned mem_buffer, as sgpt_init allocates.
+  const uintptr_t mem_base = ctx->measure ? 0 : (uintptr_t)ctx->mem_buffer;
+  const size_t mem_end =
+      ctx->measure ? ctx->mem_needed : sgpt_objects_end_offset(ctx);
+  const uintptr_t data_addr =
+      mem_base + mem_end + sizeof(sgpt_object) + sizeof(sgpt_tensor);
+  const size_t padding =
+      alloc ? SGPT_PAD(data_addr, ctx->data_alignment) - data_addr : 0;
+
+  const size_t size_needed = sizeof(sgpt_tensor) + padding + data_size;
+  sgpt_object* const obj_new =
+      sgpt_new_object(ctx, SGPT_OBJECT_TENSOR,
+                      ctx->measure ? sizeof(sgpt_tensor) : size_needed);
+  obj_new->padding = ctx->measure ? 0 : padding;
+  if (ctx->measure) {
+    ctx->mem_needed += SGPT_PAD(size_needed, SGPT_OBJECT_ALIGN) - obj_new->size;
+  }
+
+  sgpt_tensor* const result =
+      (sgpt_tensor*)((char*)ctx->mem_buffer + obj_new->offset);
+  void* result_data = data;
+  if (view_src != NULL) {
+    result_data = view_src->data != NULL ? view_src->data + view_offs : NULL;
+  } else if (alloc && !ctx->measure) {
+    result_data = (char*)(result + 1) + padding;
+  }
+  *result = (sgpt_tensor){
+      .type = type,
+      .n_dims = n_dims,
+      .ne = {1, 1, 1, 1},  // placeholder
+      .nb = {0, 0, 0, 0},  // placeholder
+      .op = SGPT_OP_NONE,
+      .src0 = NULL,
+      .src1 = NULL,
+      .n_srcs = 0,
+      .srcs = NULL,
+      .view_src = view_src,
+      .view_offs = view_offs,
+      .data = result_data,
+      .name = "",
+  };
+  for (int i = 0; i < n_dims; i++) result->ne[i] = ne[i];
+  result->nb[0] = SGPT_TYPE_SIZE[type];
+  result->nb[1] = result->nb[0] * (result->ne[0] / SGPT_BLCK_SIZE[type]);
+  result->nb[2] = result->nb[1] * result->ne[1];
+  result->nb[3] = result->nb[2] * result->ne[2];
+
+  return result;
+}
+
+// Allocates size bytes of raw data aligned like tensor data. A measure context
+// only counts them and returns NULL.
+static void* sgpt_new_buffer(sgpt_context* ctx, size_t size) {
+  const uintptr_t mem_base = ctx->measure ? 0 : (uintptr_t)ctx->mem_buffer;
+  const size_t mem_end =
+      ctx->measure ? ctx->mem_needed : sgpt_objects_end_offset(ctx);
+  const uintptr_t data_addr = mem_base + mem_end + sizeof(sgpt_object);
+  const size_t padding = SGPT_PAD(data_addr, ctx->data_alignment) - data_addr;
+
+  sgpt_object* const obj_new = sgpt_new_object(
+      ctx, SGPT_OBJECT_BUFFER, ctx->measure ? 0 : padding + size);
+  obj_new->padding = ctx->measure ? 0 : padding;
+  if (ctx->measure) {
+    ctx->mem_needed += SGPT_PAD(padding + size, SGPT_OBJECT_ALIGN);
+    return NULL;
+  }
+  return (char*)ctx->mem_buffer + obj_new->offset + padding;
+}
+
+static sgpt_tensor* sgpt_new_tensor(sgpt_context* ctx, sgpt_type type,
+                                    int n_dims, const int64_t* ne) {
+  return sgpt_new_tensor_impl(ctx, type, n_dims, ne, NULL, 0, NULL);
+}
+
+sgpt_tensor* sgpt_new_tensor_1d(sgpt_context* ctx, sgpt_type type,
+                                int64_t ne0) {
+  return sgpt_new_tensor(ctx, type, 1, &ne0);
+}
+
+sgpt_tensor* sgpt_new_tensor_2d(sgpt_context* ctx, sgpt_type type, int64_t ne0,
+                                int64_t ne1) {
+  const int64_t ne[2] = {ne0, ne1};
+  return sgpt_new_tensor(ctx, type, 2, ne);
+}
+
+sgpt_tensor* sgpt_new_tensor_3d(sgpt_context* ctx, sgpt_type type, int64_t ne0,
+                                int64_t ne1, int64_t ne2) {
+  const int64_t ne[3] = {ne0, ne1, ne2};
+  return sgpt_new_tensor(ctx, type, 3, ne);
+}
+
+sgpt_tensor* sgpt_new_tensor_4d(sgpt_context* ctx, sgpt_type type, int64_t ne0,
+                                int64_t ne1, int64_t ne2, int64_t ne3) {
+  const int64_t ne[4] = {ne0, ne1, ne2, ne3};
+  return sgpt_new_tensor(ctx, type, 4, ne);
+}
+
+sgpt_tensor* sgpt_dup_tensor(sgpt_context* ctx, const sgpt_tensor* src) {
+  return sgpt_new_tensor_impl(ctx, src->type, src->n_dims, src->ne, NULL, 0,
+                              NULL);
+}
+
+sgpt_tensor* sgpt_view_tensor(sgpt_context* ctx, const sgpt_tensor* src) {
+  sgpt_tensor* const result = sgpt_new_tensor_impl(
+      ctx, src->type, src->n_dims, src->ne, (sgpt_tensor*)src, 0, NULL);
+  for (int i = 0; i < SGPT_MAX_DIMS; i++) result->nb[i] = src->nb[i];
+  return result;
+}
+
+// FNV-1a
+static uint64_t sgpt_hash_name(const char* name) {
+  uint64_t h = 0xcbf29ce484222325u;
+  for (const char* c = name; *c != '\0'; c++) {
+    h = (h ^ (uint8_t)*c) * 0x100000001b3u;
+  }
+  return h;
+}
+
+static void sgpt_name_index_insert(sgpt_name_index* index,
+                                   sgpt_name_entry entry) {
+  const size_t mask = index->size - 1;
+  size_t i = entry.hash & mask;
+  while (index->table[i].tensor != NULL) i = (i + 1) & mask;
+  index->table[i] = entry;
+}
+
+static void sgpt_name_index_grow(sgpt_name_index* index) {
+  const size_t size = index->size > 0 ? 2 * index->size : 64;
+  free(index->table);
+  index->table = calloc(size, sizeof(sgpt_name_entry));
+  index->log = realloc(index->log, sizeof(sgpt_name_entry) * (size / 2));
+  assert(index->table != NULL && index->log != NULL);
+  index->size = size;
+  for (size_t i = 0; i < index->n_entries; i++) {
+    sgpt_name_index_insert(index, index->log[i]);
+  }
+}
+
+// Removes the entry of the name that was set last.
+static void sgpt_name_index_pop(sgpt_name_index* index) {
+  assert(index->n_entries > 0);
+  const sgpt_name_entry entry = index->log[--index->n_entries];
+  const size_t mask = index->size - 1;
+  size_t i = entry.hash & mask;
+  while (index->table[i].tensor != entry.tensor ||
+         index->table[i].hash != entry.hash) {
+    i = (i + 1) & mask;
+  }
+  // move back the entries after it that would no longer be found
+  for (size_t j = (i + 1) & mask; index->table[j].tensor != NULL;
+       j = (j + 1) & mask) {
+    const size_t home = index->table[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      index->table[i] = index->table[j];
+      i = j;
+    }
+  }
+  index->table[i] = (sgpt_name_entry){.tensor = NULL, .hash = 0};
+}
+
+sgpt_tensor* sgpt_set_name(sgpt_context* ctx, sgpt_tensor* tensor,
+                           const char* name) {
+  const size_t len = strlen(name);
+  assert(len < SGPT_MAX_NAME);
+  memcpy(tensor->name, name, len + 1);
+  if (len == 0) return tensor;
+  if (ctx->names == NULL) {
+    ctx->names = calloc(1, sizeof(sgpt_name_index));
+    assert(ctx->names != NULL);
+  }
+  sgpt_name_index* const index = ctx->names;
+  if (2 * (index->n_entries + 1) > index->size) sgpt_name_index_grow(index);
+  // a renamed tensor keeps the entry of its old name, which lookups skip
+  const sgpt_name_entry entry = {.tensor = tensor,
+                                 .hash = sgpt_hash_name(name)};
+  index->log[index->n_entries++] = entry;
+  sgpt_name_index_insert(index, entry);
+  return tensor;
+}
+
+const char* sgpt_get_name(const sgpt_tensor* tensor) { return tensor->name; }
+
+sgpt_tensor* sgpt_get_tensor(const sgpt_context* ctx, const char* name) {
+  const sgpt_name_index* const index = ctx->names;
+  if (index == NULL) return NULL;
+  const uint64_t hash = sgpt_hash_name(name);
+  const size_t mask = index->size - 1;
+  for (size_t i = hash & mask; index->table[i].tensor != NULL;
+       i = (i + 1) & mask) {
+    sgpt_tensor* const tensor = index->table[i].tensor;
+    if (index->table[i].hash == hash && strcmp(tensor->name, name) == 0) {
+      return tensor;
+    }
+  }
+  return NULL;
+}
+
+// A view of a with shape ne, starting offset bytes into the data of a, whose
+// strides are the contiguous ones until the caller sets them.
+static sgpt_tensor* sgpt_view_impl(sgpt_context* ctx, sgpt_tensor* a,
+                                   int n_dims, const int64_t* ne,
+                                   size_t offset) {
+  return sgpt_new_tensor_impl(ctx, a->type, n_dims, ne, a, offset, NULL);
+}
+
+// Checks that the view stays inside the data of the tensor it aliases.
+static void sgpt_view_check(const sgpt_tensor* view) {
+  (void)view;
+  assert(view->view_offs + sgpt_nbytes(view) <= sgpt_nbytes(view->view_src));
+}
+
+sgpt_tensor* sgpt_view_1d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          size_t offset) {
+  sgpt_tensor* const result = sgpt_view_impl(ctx, a, 1, &ne0, offset);
+  sgpt_view_check(result);
+  return result;
+}
+
+sgpt_tensor* sgpt_view_2d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          int64_t ne1, size_t nb1, size_t offset) {
+  const int64_t ne[2] = {ne0, ne1};
+  sgpt_tensor* const result = sgpt_view_impl(ctx, a, 2, ne, offset);
+  result->nb[1] = nb1;
+  result->nb[2] = result->nb[1] * ne1;
+  result->nb[3] = result->nb[2];
+  sgpt_view_check(result);
+  return result;
+}
+
+sgpt_tensor* sgpt_view_3d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          int64_t ne1, int64_t ne2, size_t nb1, size_t nb2,
+                          size_t offset) {
+  const int64_t ne[3] = {ne0, ne1, ne2};
+  sgpt_tensor* const result = sgpt_view_impl(ctx, a, 3, ne, offset);
+  result->nb[1] = nb1;
+  result->nb[2] = nb2;
+  result->nb[3] = result->nb[2] * ne2;
+  sgpt_view_check(result);
+  return result;
+}
+
+sgpt_tensor* sgpt_view_4d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                          int64_t ne1, int64_t ne2, int64_t ne3, size_t nb1,
+                          size_t nb2, size_t nb3, size_t offset) {
+  const int64_t ne[4] = {ne0, ne1, ne2, ne3};
+  sgpt_tensor* const result = sgpt_view_impl(ctx, a, 4, ne, offset);
+  result->nb[1] = nb1;
+  result->nb[2] = nb2;
+  result->nb[3] = nb3;
+  sgpt_view_check(result);
+  return result;
+}
+
+sgpt_tensor* sgpt_reshape(sgpt_context* ctx, sgpt_tensor* a,
+                          const sgpt_tensor* b) {
+  return sgpt_reshape_4d(ctx, a, b->ne[0], b->ne[1], b->ne[2], b->ne[3]);
+}
+
+sgpt_tensor* sgpt_reshape_1d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0) {
+  assert(sgpt_is_contiguous(a));
+  assert(sgpt_nelements(a) == ne0);
+  return sgpt_view_impl(ctx, a, 1, &ne0, 0);
+}
+
+sgpt_tensor* sgpt_reshape_2d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                             int64_t ne1) {
+  assert(sgpt_is_contiguous(a));
+  assert(sgpt_nelements(a) == ne0 * ne1);
+  const int64_t ne[2] = {ne0, ne1};
+  return sgpt_view_impl(ctx, a, 2, ne, 0);
+}
+
+sgpt_tensor* sgpt_reshape_3d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                             int64_t ne1, int64_t ne2) {
+  assert(sgpt_is_contiguous(a));
+  assert(sgpt_nelements(a) == ne0 * ne1 * ne2);
+  const int64_t ne[3] = {ne0, ne1, ne2};
+  return sgpt_view_impl(ctx, a, 3, ne, 0);
+}
+
+sgpt_tensor* sgpt_reshape_4d(sgpt_context* ctx, sgpt_tensor* a, int64_t ne0,
+                             int64_t ne1, int64_t ne2, int64_t ne3) {
+  assert(sgpt_is_contiguous(a));
+  assert(sgpt_nelements(a) == ne0 * ne1 * ne2 * ne3);
+  const int64_t ne[4] = {ne0, ne1, ne2, ne3};
+  return sgpt_view_impl(ctx, a, 4, ne, 0);
+}
+
+sgpt_tensor* sgpt_permute(sgpt_context* ctx, sgpt_tensor* a, int axis0,
+                          int axis1, int axis2, int axis3) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  const int axes[4] = {axis0, axis1, axis2, axis3};
+  assert(axis0 != axis1 && axis0 != axis2 && axis0 != axis3);
+  assert(axis1 != axis2 && axis1 != axis3 && axis2 != axis3);
+  // the elements of a quantized block must stay in dimension 0
+  assert(SGPT_BLCK_SIZE[a->type] == 1 || axis0 == 0);
+  // dimension i of a becomes dimension axes[i] of the result
+  int64_t ne[4];
+  size_t nb[4];
+  int n_dims = a->n_dims;
+  for (int i = 0; i < 4; i++) {
+    assert(axes[i] >= 0 && axes[i] < 4);
+    ne[axes[i]] = a->ne[i];
+    nb[axes[i]] = a->nb[i];
+    if (a->ne[i] > 1) n_dims = SGPT_MAX(n_dims, axes[i] + 1);
+  }
+  sgpt_tensor* const result = sgpt_view_impl(ctx, a, n_dims, ne, 0);
+  for (int i = 0; i < 4; i++) {
+    result->ne[i] = ne[i];
+    result->nb[i] = nb[i];
+  }
+  return result;
+}
+
+sgpt_tensor* sgpt_transpose(sgpt_context* ctx, sgpt_tensor* a) {
+  return sgpt_permute(ctx, a, 1, 0, 2, 3);
+}
+
+int32_t sgpt_get_i32(const sgpt_tensor* tensor, int n_dims, const int* idxs) {
+  assert(tensor->type == SGPT_TYPE_I32);
+  int loc = 0;
+  for (int i = 0; i < n_dims; i++) {
+    assert(idxs[i] <= tensor->ne[i]);
+    loc += idxs[i] * tensor->nb[i];
+  }
+  return ((int32_t*)(tensor->data + loc))[0];
+}
+
+int32_t sgpt_get_i32_1d(const sgpt_tensor* tensor, int i0) {
+  return sgpt_get_i32(tensor, 1, &i0);
+}
+
+int32_t sgpt_get_i32_2d(const sgpt_tensor* tensor, int i0, int i1) {
+  const int idxs[2] = {i0, i1};
+  return sgpt_get_i32(tensor, 2, idxs);
+}
+
+int32_t sgpt_get_i32_3d(const sgpt_tensor* tensor, int i0, int i1, int i2) {
+  const int idxs[3] = {i0, i1, i2};
+  return sgpt_get_i32(tensor, 3, idxs);
+}
+
+int32_t sgpt_get_i32_4d(const sgpt_tensor* tensor, int i0, int i1, int i2,
+                        int i3) {
+  const int idxs[4] = {i0, i1, i2, i3};
+  return sgpt_get_i32(tensor, 4, idxs);
+}
+
+void sgpt_set_i32(const sgpt_tensor* tensor, int n_dims, const int* idxs,
+                  int32_t value) {
+  assert(tensor->type == SGPT_TYPE_I32);
+  int loc = 0;
+  for (int i = 0; i < n_dims; i++) {
+    assert(idxs[i] <= tensor->ne[i]);
+    loc += idxs[i] * tensor->nb[i];
+  }
+  ((int32_t*)(tensor->data + loc))[0] = value;
+}
+
+void sgpt_set_i32_1d(sgpt_tensor* tensor, int i0, int32_t value) {
+  return sgpt_set_i32(tensor, 1, &i0, value);
+}
+
+void sgpt_set_i32_2d(sgpt_tensor* tensor, int i0, int i1, int32_t value) {
+  const int idxs[2] = {i0, i1};
+  return sgpt_set_i32(tensor, 2, idxs, value);
+}
+
+void sgpt_set_i32_3d(sgpt_tensor* tensor, int i0, int i1, int i2,
+                     int32_t value) {
+  const int idxs[3] = {i0, i1, i2};
+  return sgpt_set_i32(tensor, 3, idxs, value);
+}
+
+void sgpt_set_i32_4d(sgpt_tensor* tensor, int i0, int i1, int i2, int i3,
+                     int32_t value) {
+  const int idxs[4] = {i0, i1, i2, i3};
+  return sgpt_set_i32(tensor, 4, idxs, value);
+}
+
+int64_t sgpt_blck_size(sgpt_type type) { return SGPT_BLCK_SIZE[type]; }
+
+size_t sgpt_type_size(sgpt_type type) { return SGPT_TYPE_SIZE[type]; }
+
+const char* sgpt_type_name(sgpt_type type) { return SGPT_TYPE_NAME[type]; }
+
+const char* sgpt_op_name(sgpt_op op) { return SGPT_OP_NAME[op]; }
+
+size_t sgpt_row_size(sgpt_type type, int64_t ne0) {
+  assert(ne0 % SGPT_BLCK_SIZE[type] == 0);
+  return SGPT_TYPE_SIZE[type] * (ne0 / SGPT_BLCK_SIZE[type]);
+}
+
+float sgpt_fp16_to_fp32(sgpt_fp16_t h) { return sgpt_compute_fp16_to_fp32(h); }
+
+sgpt_fp16_t sgpt_fp32_to_fp16(float f) { return sgpt_compute_fp32_to_fp16(f); }
+
+float sgpt_bf16_to_fp32(sgpt_bf16_t h) { return sgpt_compute_bf16_to_fp32(h); }
+
+sgpt_bf16_t sgpt_fp32_to_bf16(float f) { return sgpt_compute_fp32_to_bf16(f); }
+
+// The row conversions may run before any context picked the row kernels.
+void sgpt_fp16_to_fp32_row(const sgpt_fp16_t* x, float* y, int64_t n) {
+  pthread_once(&sgpt_vec_once, sgpt_vec_init);
+  sgpt_vec.to_f32[SGPT_TYPE_F16](n, y, x);
+}
+
+void sgpt_fp32_to_fp16_row(const float* x, sgpt_fp16_t* y, int64_t n) {
+  pthread_once(&sgpt_vec_once, sgpt_vec_init);
+  sgpt_vec.from_f32[SGPT_TYPE_F16](n, y, x);
+}
+
+void sgpt_bf16_to_fp32_row(const sgpt_bf16_t* x, float* y, int64_t n) {
+  pthread_once(&sgpt_vec_once, sgpt_vec_init);
+  sgpt_vec.to_f32[SGPT_TYPE_BF16](n, y, x);
+}
+
+void sgpt_fp32_to_bf16_row(const float* x, sgpt_bf16_t* y, int64_t n) {
+  pthread_once(&sgpt_vec_once, sgpt_vec_init);
+  sgpt_vec.from_f32[SGPT_TYPE_BF16](n, y, x);
+}
+
+static sgpt_tensor* sgpt_dup_impl(sgpt_context* ctx, sgpt_tensor* a,
+                                  bool inplace) {
+  sgpt_tensor* result =
+      inplace ? sgpt_view_tensor(ctx, a) : sgpt_dup_tensor(ctx, a);
+  result->op = SGPT_OP_DUP;
+  result->src0 = a;
+  result->src1 = NULL;
+  return result;
+}
+
+sgpt_tensor* sgpt_dup(sgpt_context* ctx, sgpt_tensor* a) {
+  return sgpt_dup_impl(ctx, a, false);
+}
+
+sgpt_tensor* sgpt_dup_inplace(sgpt_context* ctx, sgpt_tensor* a) {
+  return sgpt_dup_impl(ctx, a, true);
+}
+
+sgpt_tensor* sgpt_cpy(sgpt_context* ctx, sgpt_tensor* a, sgpt_tensor* b) {
+  assert(sgpt_are_same_shape(a, b));
+  sgpt_tensor* const result = sgpt_view_tensor(ctx, b);
+  result->op = SGPT_OP_DUP;
+  result->src0 = a;
+  // orders the copy after whatever computes b
+  result->src1 = b;
+  return result;
+}
+
+sgpt_tensor* sgpt_cast(sgpt_context* ctx, sgpt_tensor* a, sgpt_type type) {
+  sgpt_tensor* const result =
+      sgpt_new_tensor_impl(ctx, type, a->n_dims, a->ne, NULL, 0, NULL);
+  result->op = SGPT_OP_DUP;
+  result->src0 = a;
+  result->src1 = NULL;
+  return result;
+}
+
+sgpt_type sgpt_promote_type(sgpt_type a, sgpt_type b) {
+  return a == b ? a : SGPT_TYPE_F32;
+}
+
+static sgpt_tensor* sgpt_add_impl(sgpt_context* ctx, sgpt_tensor* a,
+                                  sgpt_tensor* b, bool inplace) {
+  // b is broadcast along the dimensions where it has a single element
+  assert(sgpt_can_repeat(b, a));
+  sgpt_tensor* result =
+      inplace ? sgpt_view_tensor(ctx, a)
+              : sgpt_new_tensor_impl(ctx, sgpt_promote_type(a->type, b->type),
+                                     a->n_dims, a->ne, NULL, 0, NULL);
+  result->op = SGPT_OP_ADD;
+  result->src0 = a;
+  result->src1 = b;
+  return result;
+}
+
+sgpt_tensor* sgpt_add(sgpt_context* ctx, sgpt_tensor* a, sgpt_tensor* b) {
+  return sgpt_add_impl(ctx, a, b, false);
+}
+
+sgpt_tensor* sgpt_add_inplace(sgpt_context* ctx, sgpt_tensor* a,
+                              sgpt_tensor* b) {
+  return sgpt_add_impl(ctx, a, b, true);
+}
+
+static inline size_t sgpt_hash(const void* p) {
+  // tensors are at least 8 byte aligned, drop the bits that never change
+  return (size_t)((uintptr_t)p >> 3);
+}
+
+// Returns the smallest prime that is at least min_size.
+static size_t sgpt_hash_size(size_t min_size) {
+  for (size_t n = SGPT_MAX(min_size, 2);; n++) {
+    bool is_prime = true;
+    for (size_t d = 2; d * d <= n; d++) {
+      if (n % d == 0) {
+        is_prime = false;
+        break;
+      }
+    }
+    if (is_prime) return n;
+  }
+}
+
+// Inserts p into an open addressing hash set and returns whether it was
+// already there.
+static bool sgpt_hash_insert(sgpt_tensor** table, size_t size,
+                             sgpt_tensor* p) {
+  size_t i = sgpt_hash(p) % size;
+  while (table[i] != NULL) {
+    if (table[i] == p) return true;
+    i = i + 1 == size ? 0 : i + 1;
+  }
+  table[i] = p;
+  return false;
+}
+
+// A tensor whose parents are being visited. n_visited counts the sources
+// (src0, then src1, or srcs in order) that were already pushed.
+typedef struct sgpt_visit_frame {
+  sgpt_tensor* node;
+  int n_visited;
+} sgpt_visit_frame;
+
+sgpt_cgraph* sgpt_new_graph(sgpt_context* ctx, int size) {
+  assert(size > 0);
+  // keep the visited set at most half full with size nodes and size leafs
+  const size_t hash_size = sgpt_hash_size(4 * (size_t)size);
+  const size_t nodes_size = sizeof(sgpt_tensor*) * size;
+  const size_t hash_table_size = sizeof(sgpt_tensor*) * hash_size;
+  // every frame holds a distinct tensor that ends up in nodes or leafs
+  const size_t visit_stack_size = sizeof(sgpt_visit_frame) * 2 * size;
+  sgpt_object* const obj = sgpt_new_object(
+      ctx, SGPT_OBJECT_GRAPH,
+      sizeof(sgpt_cgraph) + 3 * nodes_size + hash_table_size +
+          visit_stack_size);
+
+  char* const mem = (char*)ctx->mem_buffer + obj->offset;
+  sgpt_cgraph* const cgraph = (sgpt_cgraph*)mem;
+  *cgraph = (sgpt_cgraph){
+      .size = size,
+      .n_nodes = 0,
+      .n_leafs = 0,
+      .nodes = (sgpt_tensor**)(mem + sizeof(sgpt_cgraph)),
+      .leafs = (sgpt_tensor**)(mem + sizeof(sgpt_cgraph) + nodes_size),
+      .visited_hash_size = hash_size,
+      .visited_hash_table =
+          (sgpt_tensor**)(mem + sizeof(sgpt_cgraph) + 2 * nodes_size),
+      .visit_stack = (sgpt_visit_frame*)(mem + sizeof(sgpt_cgraph) +
+                                         2 * nodes_size + hash_table_size),
+      .n_outputs = 0,
+      .outputs = (sgpt_tensor**)(mem + sizeof(sgpt_cgraph) + 2 * nodes_size +
+                                 hash_table_size + visit_stack_size),
+      .perf = NULL,
+  };
+  sgpt_graph_reset(cgraph);
+  return cgraph;
+}
+
+void sgpt_graph_reset(sgpt_cgraph* cgraph) {
+  cgraph->n_nodes = 0;
+  cgraph->n_leafs = 0;
+  cgraph->n_outputs = 0;
+  if (cgraph->perf != NULL) {
+    memset(cgraph->perf, 0, sizeof(sgpt_perf) * cgraph->size);
+  }
+  memset(cgraph->visited_hash_table, 0,
+         sizeof(sgpt_tensor*) * cgraph->visited_hash_size);
+}
+
+static void sgpt_graph_add(sgpt_cgraph* cgraph, sgpt_tensor* node) {
+  if (node->op == SGPT_OP_NONE) {
+    assert(cgraph->n_leafs < cgraph->size);
+    cgraph->leafs[cgraph->n_leafs] = node;
+    cgraph->n_leafs++;
+  } else {
+    assert(cgraph->n_nodes < cgraph->size);
+    cgraph->nodes[cgraph->n_nodes] = node;
+    cgraph->n_nodes++;
+  }
+}
+
+// Visits the parents of node depth first with an explicit stack so that deep
+// chains cannot overflow the C stack. Nodes are appended in post-order, the
+// same order a recursive src0-then-src1 traversal produces.
+static void sgpt_visit_parents(sgpt_cgraph* cgraph, sgpt_tensor* node) {
+  if (sgpt_hash_insert(cgraph->visited_hash_table, cgraph->visited_hash_size,
+                       node)) {
+    return;
+  }
+  sgpt_visit_frame* const stack = cgraph->visit_stack;
+  int n_stack = 0;
+  stack[n_stack++] = (sgpt_visit_frame){.node = node, .n_visited = 0};
+  while (n_stack > 0) {
+    sgpt_visit_frame* const top = &stack[n_stack - 1];
+    if (top->n_visited == sgpt_n_srcs(top->node)) {
+      sgpt_graph_add(cgraph, top->node);
+      n_stack--;
+      continue;
+    }
+    sgpt_tensor* const src = sgpt_get_src(top->node, top->n_visited);
+    top->n_visited++;
+    if (src == NULL || sgpt_hash_insert(cgraph->visited_hash_table,
+                                        cgraph->visited_hash_size, src)) {
+      continue;
+    }
+    assert(n_stack < 2 * cgraph->size);
+    stack[n_stack++] = (sgpt_visit_frame){.node = src, .n_visited = 0};
+  }
+}
+
+void sgpt_build_forward_expand(sgpt_cgraph* cgraph, sgpt_tensor* tensor) {
+  const int n_tensors = cgraph->n_nodes + cgraph->n_leafs;
+  const int n_nodes = cgraph->n_nodes;
+  sgpt_visit_parents(cgraph, tensor);
+  if (cgraph->n_nodes > n_nodes) {
+    assert(cgraph->nodes[cgraph->n_nodes - 1] == tensor);
+  }
+  // a tensor already in the graph may have been expanded before
+  if (cgraph->n_nodes + cgraph->n_leafs == n_tensors) {
+    for (int i = 0; i < cgraph->n_outputs; i++) {
+      if (cgraph->outputs[i] == tensor) return;
+    }
+  }
+  assert(cgraph->n_outputs < cgraph->size);
+  cgraph->outputs[cgraph->n_outputs++] = tensor;
+}
+
+// Counts the tensors tensor depends on, itself included, with scratch memory
+// from the heap.
+static int sgpt_count_reachable(sgpt_tensor* tensor) {
+  size_t hash_size = sgpt_hash_size(64);
+  sgpt_tensor** table = calloc(hash_size, sizeof(sgpt_tensor*));
+  int n_stack_max = 64;
+  sgpt_tensor** stack = malloc(sizeof(sgpt_tensor*) * n_stack_max);
+  assert(table != NULL && stack != NULL);
+  int n_found = 1;
+  int n_stack = 0;
+  sgpt_hash_insert(table, hash_size, tensor);
+  stack[n_stack++] = tensor;
+  while (n_stack > 0) {
+    sgpt_tensor* const node = stack[--n_stack];
+    for (int i = 0; i < sgpt_n_srcs(node); i++) {
+      sgpt_tensor* const src = sgpt_get_src(node, i);
+      if (src == NULL || sgpt_hash_insert(table, hash_size, src)) continue;
+      n_found++;
+      if (n_stack == n_stack_max) {
+        n_stack_max *= 2;
+        stack = realloc(stack, sizeof(sgpt_tensor*) * n_stack_max);
+        assert(stack != NULL);
+      }
+      stack[n_stack++] = src;
+      // keep the set at most half full
+      if (2 * (size_t)n_found > hash_size) {
+        const size_t new_size = sgpt_hash_size(4 * (size_t)n_found);
+        sgpt_tensor** const new_table =
+            calloc(new_size, sizeof(sgpt_tensor*));
+        assert(new_table != NULL);
+        for (size_t j = 0; j < hash_size; j++) {
+          if (table[j] != NULL) sgpt_hash_insert(new_table, new_size, table[j]);
+        }
+        free(table);
+        table = new_table;
+        hash_size = new_size;
+      }
+    }
+  }
+  free(stack);
+  free(table);
+  return n_found;
+}
+
+sgpt_cgraph* sgpt_build_forward(sgpt_context* ctx, sgpt_tensor* tensor) {
+  // exactly as large as the graph, which small contexts can afford
+  sgpt_cgraph* const cgraph =
+      sgpt_new_graph(ctx, sgpt_count_reachable(tensor));
+  sgpt_build_forward_expand(cgraph, tensor);
+  return cgraph;
+}
+
+// Free regions of the scratch buffer planned by sgpt_graph_alloc, sorted by
+// offset. Everything from top upwards is free as well.
+typedef struct sgpt_free_list {
+  int n_blocks;
+  size_t* offsets;
+  size_t* sizes;
+  size_t top;
+  size_t peak;
+} sgpt_free_list;
+
+// Returns the offset of a region of size bytes, taking the smallest free
+// block that fits or growing the buffer.
+static size_t sgpt_free_list_alloc(sgpt_free_list* fl, size_t size) {
+  int best = -1;
+  for (int i = 0; i < fl->n_blocks; i++) {
+    if (fl->sizes[i] >= size &&
+        (best == -1 || fl->sizes[i] < fl->sizes[best])) {
+      best = i;
+    }
+  }
+  if (best == -1) {
+    const size_t offset = fl->top;
+    fl->top += size;
+    fl->peak = SGPT_MAX(fl->peak, fl->top);
+    return offset;
+  }
+  const size_t offset = fl->offsets[best];
+  fl->offsets[best] += size;
+  fl->sizes[best] -= size;
+  if (fl->sizes[best] == 0) {
+    for (int i = best; i < fl->n_blocks - 1; i++) {
+      fl->offsets[i] = fl->offsets[i + 1];
+      fl->sizes[i] = fl->sizes[i + 1];
+    }
+    fl->n_blocks--;
+  }
+  return offset;
+}
+
+static void sgpt_free_list_free(sgpt_free_list* fl, size_t offset,
+                                size_t size) {
+  int i = 0;
+  while (i < fl->n_blocks && fl->offsets[i] < offset) i++;
+  // merge with the neighbouring blocks where they touch
+  const bool merge_prev =
+      i > 0 && fl->offsets[i - 1] + fl->sizes[i - 1] == offset;
+  const bool merge_next = i < fl->n_blocks && offset + size == fl->offsets[i];
+  if (merge_prev && merge_next) {
+    fl->sizes[i - 1] += size + fl->sizes[i];
+    for (int k = i; k < fl->n_blocks - 1; k++) {
+      fl->offsets[k] = fl->offsets[k + 1];
+      fl->sizes[k] = fl->sizes[k + 1];
+    }
+    fl->n_blocks--;
+    i--;
+  } else if (merge_prev) {
+    fl->sizes[i - 1] += size;
+    i--;
+  } else if (merge_next) {
+    fl->offsets[i] = offset;
+    fl->sizes[i] += size;
+  } else {
+    for (int k = fl->n_blocks; k > i; k--) {
+      fl->offsets[k] = fl->offsets[k - 1];
+      fl->sizes[k] = fl->sizes[k - 1];
+    }
+    fl->offsets[i] = offset;
+    fl->sizes[i] = size;
+    fl->n_blocks++;
+  }
+  // a block that reaches the top gives its space back to the top
+  if (fl->offsets[i] + fl->sizes[i] == fl->top) {
+    fl->top = fl->offsets[i];
+    fl->n_blocks--;
+  }
+}
+
+// What sgpt_graph_alloc knows about one tensor.
+typedef struct sgpt_alloc_info {
+  sgpt_tensor* tensor;
+  int n_children;  // nodes that still have to read the tensor
+  int n_views;     // views of the tensor that are still alive
+  bool planned;    // data is assigned by the planner
+  bool owns_region;  // holds a scratch region that is freed once unused
+  size_t offset;
+  size_t size;
+} sgpt_alloc_info;
+
+typedef struct sgpt_allocr {
+  sgpt_alloc_info* infos;
+  size_t hash_size;
+  sgpt_free_list free_list;
+  sgpt_tensor** order;  // planned tensors, owners before their views
+  int n_order;
+  size_t alignment;
+} sgpt_allocr;
+
+static sgpt_alloc_info* sgpt_allocr_get(sgpt_allocr* alloc,
+                                        sgpt_tensor* tensor) {
+  size_t i = sgpt_hash(tensor) % alloc->hash_size;
+  while (alloc->infos[i].tensor != NULL && alloc->infos[i].tensor != tensor) {
+    i = i + 1 == alloc->hash_size ? 0 : i + 1;
+  }
+  alloc->infos[i].tensor = tensor;
+  return &alloc->infos[i];
+}
+
+// Whether node may write its result over parent, which is an intermediate
+// that nothing reads after node.
+static bool sgpt_allocr_can_inplace(sgpt_allocr* alloc, sgpt_tensor* node,
+                                    sgpt_tensor* parent) {
+  if (parent == NULL || parent->view_src != NULL) return false;
+  const sgpt_alloc_info* const p = sgpt_allocr_get(alloc, parent);
+  return p->owns_region && p->n_children == 1 && p->n_views == 0 &&
+         parent->type == node->type && sgpt_are_same_shape(parent, node) &&
+         sgpt_is_contiguous(parent) && sgpt_is_contiguous(node);
+}
+
+static void sgpt_allocr_plan(sgpt_allocr* alloc, sgpt_tensor* tensor) {
+  sgpt_alloc_info* const info = sgpt_allocr_get(alloc, tensor);
+  if (info->planned) return;
+  if (tensor->view_src != NULL) {
+    sgpt_allocr_plan(alloc, tensor->view_src);
+    info->planned = true;
+    alloc->order[alloc->n_order++] = tensor;
+    return;
+  }
+  if (tensor->data != NULL) return;
+
+  info->planned = true;
+  info->size = SGPT_PAD(sgpt_nbytes(tensor), alloc->alignment);
+  alloc->order[alloc->n_order++] = tensor;
+  if (tensor->op == SGPT_OP_NONE) {
+    // leafs hold inputs and are never reused
+    info->offset = sgpt_free_list_alloc(&alloc->free_list, info->size);
+    return;
+  }
+  // every op is element-wise, so any input read only here can be overwritten
+  for (int i = 0; i < sgpt_n_srcs(tensor); i++) {
+    sgpt_tensor* const parent = sgpt_get_src(tensor, i);
+    if (sgpt_allocr_can_inplace(alloc, tensor, parent)) {
+      sgpt_alloc_info* const p = sgpt_allocr_get(alloc, parent);
+      info->offset = p->offset;
+      p->owns_region = false;
+      info->owns_region = true;
+      return;
+    }
+  }
+  info->offset = sgpt_free_list_alloc(&alloc->free_list, info->size);
+  info->owns_region = true;
+}
+
+static void sgpt_allocr_release(sgpt_allocr* alloc, sgpt_alloc_info* info) {
+  if (info->n_children > 0 || info->n_views > 0) return;
+  if (info->tensor->view_src != NULL) {
+    sgpt_alloc_info* const owner =
+        sgpt_allocr_get(alloc, info->tensor->view_src);
+    owner->n_views--;
+    sgpt_allocr_release(alloc, owner);
+    return;
+  }
+  if (info->owns_region) {
+    sgpt_free_list_free(&alloc->free_list, info->offset, info->size);
+    info->owns_region = false;
+  }
+}
+
+size_t sgpt_graph_alloc(sgpt_context* ctx, sgpt_cgraph* cgraph) {
+  const int n_tensors = cgraph->n_nodes + cgraph->n_leafs;
+  // view owners outside of the graph may add up to n_tensors more entries
+  const size_t hash_size = sgpt_hash_size(4 * (size_t)n_tensors + 1);
+  sgpt_allocr alloc = {
+      .infos = calloc(hash_size, sizeof(sgpt_alloc_info)),
+      .hash_size = hash_size,
+      .free_list =
+          {
+              .n_blocks = 0,
+              .offsets = malloc(sizeof(size_t) * (2 * n_tensors + 1)),
+              .sizes = malloc(sizeof(size_t) * (2 * n_tensors + 1)),
+              .top = 0,
+              .peak = 0,
+          },
+      .order = malloc(sizeof(sgpt_tensor*) * (2 * n_tensors + 1)),
+      .n_order = 0,
+      .alignment = ctx->data_alignment,
+  };
+  assert(alloc.infos != NULL && alloc.order != NULL);
+  assert(alloc.free_list.offsets != NULL && alloc.free_list.sizes != NULL);
+
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    sgpt_tensor* const node = cgraph->nodes[i];
+    for (int j = 0; j < sgpt_n_srcs(node); j++) {
+      sgpt_allocr_get(&alloc, sgpt_get_src(node, j))->n_children++;
+    }
+  }
+  // the caller reads the tensors it expanded after compute, so they are never
+  // released
+  for (int i = 0; i < cgraph->n_outputs; i++) {
+    sgpt_allocr_get(&alloc, cgraph->outputs[i])->n_children++;
+  }
+  for (int i = 0; i < n_tensors; i++) {
+    sgpt_tensor* const tensor = i < cgraph->n_leafs
+                                    ? cgraph->leafs[i]
+                                    : cgraph->nodes[i - cgraph->n_leafs];
+    if (tensor->view_src) {
+      sgpt_allocr_get(&alloc, tensor->view_src)->n_views++;
+    }
+  }
+
+  for (int i = 0; i < cgraph->n_leafs; i++) {
+    sgpt_allocr_plan(&alloc, cgraph->leafs[i]);
+  }
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    sgpt_tensor* const node = cgraph->nodes[i];
+    sgpt_allocr_plan(&alloc, node);
+    for (int j = 0; j < sgpt_n_srcs(node); j++) {
+      sgpt_alloc_info* const info =
+          sgpt_allocr_get(&alloc, sgpt_get_src(node, j));
+      info->n_children--;
+      sgpt_allocr_release(&alloc, info);
+    }
+  }
+
+  const size_t size = alloc.free_list.peak;
+  char* const buffer = size > 0 ? sgpt_new_buffer(ctx, size) : NULL;
+  if (buffer != NULL) {
+    for (int i = 0; i < alloc.n_order; i++) {
+      sgpt_tensor* const tensor = alloc.order[i];
+      tensor->data = tensor->view_src != NULL
+                         ? tensor->view_src->data + tensor->view_offs
+                         : buffer + sgpt_allocr_get(&alloc, tensor)->offset;
+    }
+  }
+
+  free(alloc.order);
+  free(alloc.free_list.sizes);
+  free(alloc.free_list.offsets);
+  free(alloc.infos);
+  return size;
+}
+
+// What sgpt_graph_fuse knows about one tensor.
+typedef struct sgpt_fuse_info {
+  sgpt_tensor* tensor;
+  int n_consumers;        // nodes reading the tensor and views of it
+  sgpt_tensor* consumer;  // the last node reading the tensor
+  bool absorbed;    // merged into its only consumer
+} sgpt_fuse_info;
+
+static sgpt_fuse_info* sgpt_fuse_get(sgpt_fuse_info* infos, size_t hash_size,
+                                     sgpt_tensor* tensor) {
+  size_t i = sgpt_hash(tensor) % hash_size;
+  while (infos[i].tensor != NULL && infos[i].tensor != tensor) {
+    i = i + 1 == hash_size ? 0 : i + 1;
+  }
+  infos[i].tensor = tensor;
+  return &infos[i];
+}
+
+// Whether tensor is an element-wise node whose inputs can be streamed by the
+// kernel of SGPT_OP_ADD_N.
+static bool sgpt_is_fusible(const sgpt_tensor* tensor) {
+  if (tensor->op != SGPT_OP_DUP && tensor->op != SGPT_OP_ADD &&
+      tensor->op != SGPT_OP_ADD_N) {
+    return false;
+  }
+  // sgpt_cpy reads src1 only to order the copy
+  if (tensor->op == SGPT_OP_DUP && tensor->src1 != NULL) return false;
+  if (tensor->type != SGPT_TYPE_F32 && tensor->type != SGPT_TYPE_I32) {
+    return false;
+  }
+  if (!sgpt_is_contiguous(tensor)) return false;
+  for (int i = 0; i < sgpt_n_srcs(tensor); i++) {
+    const sgpt_tensor* const src = sgpt_get_src(tensor, i);
+    if (src->type != tensor->type || !sgpt_are_same_shape(src, tensor) ||
+        !sgpt_is_contiguous(src)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Writes to srcs the inputs of root once the nodes absorbed into it are
+// replaced by their own inputs, left to right. Returns their number, srcs may
+// be NULL to only count them.
+static int sgpt_fuse_collect(sgpt_fuse_info* infos, size_t hash_size,
+                             sgpt_visit_frame* stack, sgpt_tensor* root,
+                             sgpt_tensor** srcs) {
+  int n_srcs = 0;
+  int n_stack = 0;
+  stack[n_stack++] = (sgpt_visit_frame){.node = root, .n_visited = 0};
+  while (n_stack > 0) {
+    sgpt_visit_frame* const top = &stack[n_stack - 1];
+    if (top->n_visited == sgpt_n_srcs(top->node)) {
+      n_stack--;
+      continue;
+    }
+    sgpt_tensor* const src = sgpt_get_src(top->node, top->n_visited);
+    top->n_visited++;
+    if (sgpt_fuse_get(infos, hash_size, src)->absorbed) {
+      stack[n_stack++] = (sgpt_visit_frame){.node = src, .n_visited = 0};
+    } else {
+      if (srcs != NULL) srcs[n_srcs] = src;
+      n_srcs++;
+    }
+  }
+  return n_srcs;
+}
+
+int sgpt_graph_fuse(sgpt_context* ctx, sgpt_cgraph* cgraph) {
+  const int n_tensors = cgraph->n_nodes + cgraph->n_leafs;
+  const size_t hash_size = sgpt_hash_size(4 * (size_t)n_tensors + 1);
+  sgpt_fuse_info* const infos = calloc(hash_size, sizeof(sgpt_fuse_info));
+  assert(infos != NULL);
+
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    sgpt_tensor* const node = cgraph->nodes[i];
+    for (int j = 0; j < sgpt_n_srcs(node); j++) {
+      sgpt_fuse_info* const info =
+          sgpt_fuse_get(infos, hash_size, sgpt_get_src(node, j));
+      info->n_consumers++;
+      info->consumer = node;
+    }
+  }
+  for (int i = 0; i < n_tensors; i++) {
+    sgpt_tensor* const tensor = i < cgraph->n_leafs
+                                    ? cgraph->leafs[i]
+                                    : cgraph->nodes[i - cgraph->n_leafs];
+    if (tensor->view_src) {
+      sgpt_fuse_get(infos, hash_size, tensor->view_src)->n_consumers++;
+    }
+  }
+  // the caller reads the tensors it expanded, so they must be computed
+  for (int i = 0; i < cgraph->n_outputs; i++) {
+    sgpt_fuse_get(infos, hash_size, cgraph->outputs[i])->n_consumers++;
+  }
+
+  int n_absorbed = 0;
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    sgpt_tensor* const node = cgraph->nodes[i];
+    sgpt_fuse_info* const info = sgpt_fuse_get(infos, hash_size, node);
+    if (info->n_consumers == 1 && info->consumer != NULL &&
+        node->view_src == NULL && sgpt_is_fusible(node) &&
+        sgpt_is_fusible(info->consumer)) {
+      info->absorbed = true;
+      n_absorbed++;
+    }
+  }
+
+  int n_nodes = 0;
+  for (int i = 0; i < cgraph->n_nodes && n_absorbed > 0; i++) {
+    sgpt_tensor* const node = cgraph->nodes[i];
+    if (sgpt_fuse_get(infos, hash_size, node)->absorbed) continue;
+    cgraph->nodes[n_nodes++] = node;
+    bool merges = false;
+    for (int j = 0; j < sgpt_n_srcs(node); j++) {
+      sgpt_tensor* const src = sgpt_get_src(node, j);
+      merges |= sgpt_fuse_get(infos, hash_size, src)->absorbed;
+    }
+    if (!merges) continue;
+    const int n_srcs = sgpt_fuse_collect(infos, hash_size,
+                                         cgraph->visit_stack, node, NULL);
+    sgpt_object* const obj = sgpt_new_object(ctx, SGPT_OBJECT_BUFFER,
+                                             sizeof(sgpt_tensor*) * n_srcs);
+    sgpt_tensor** const srcs =
+        (sgpt_tensor**)((char*)ctx->mem_buffer + obj->offset);
+    sgpt_fuse_collect(infos, hash_size, cgraph->visit_stack, node, srcs);
+    node->op = SGPT_OP_ADD_N;
+    node->n_srcs = n_srcs;
+    node->srcs = srcs;
+    node->src0 = srcs[0];
+    node->src1 = n_srcs > 1 ? srcs[1] : NULL;
+  }
+  if (n_absorbed > 0) cgraph->n_nodes = n_nodes;
+
+  free(infos);
+  return n_absorbed;
+}
+
+// How the rows of a node are divided among its tasks. When there are fewer
+// rows than tasks, every task takes a slice of the columns of all rows instead
+// so that large 1d tensors are parallelized as well.
+typedef struct sgpt_work_split {
+  int64_t nr;  // number of rows
+  int64_t nc;  // number of columns
+  int64_t dr;  // rows per task, 0 when splitting by columns
+  int64_t dc;  // columns per task when splitting by columns
+} sgpt_work_split;
+
+static sgpt_work_split sgpt_new_work_split(const sgpt_tensor* dst,
+                                           int n_tasks) {
+  const int64_t nr = sgpt_nrows(dst);
+  const int64_t nc = dst->ne[0];
+  if (nr >= n_tasks) {
+    return (sgpt_work_split){
+        .nr = nr,
+        .nc = nc,
+        .dr = (nr + n_tasks - 1) / n_tasks,
+        .dc = nc,
+    };
+  }
+  return (sgpt_work_split){
+      .nr = nr,
+      .nc = nc,
+      .dr = 0,
+      // keep slices a multiple of a cache line of 4 byte elements and of
+      // the blocks of quantized types
+      .dc = SGPT_PAD((nc + n_tasks - 1) / n_tasks, SGPT_QK),
+  };
+}
+
+typedef struct sgpt_compute_params {
+  int ith;  // index of this task
+  int nth;  // number of tasks working on the node
+  const sgpt_work_split* split;
+} sgpt_compute_params;
+
+// Rows [ir0, ir1) and columns [i00, i01) of a node computed by one task.
+typedef struct sgpt_work_range {
+  int64_t ir0;
+  int64_t ir1;
+  int64_t i00;
+  int64_t i01;
+} sgpt_work_range;
+
+static sgpt_work_range sgpt_get_work_range(const sgpt_compute_params* params) {
+  const sgpt_work_split* const split = params->split;
+  if (split->dr > 0) {
+    const int64_t ir0 = SGPT_MIN(split->dr * params->ith, split->nr);
+    return (sgpt_work_range){
+        .ir0 = ir0,
+        .ir1 = SGPT_MIN(ir0 + split->dr, split->nr),
+        .i00 = 0,
+        .i01 = split->nc,
+    };
+  }
+  const int64_t i00 = SGPT_MIN(split->dc * params->ith, split->nc);
+  return (sgpt_work_range){
+      .ir0 = 0,
+      .ir1 = split->nr,
+      .i00 = i00,
+      .i01 = SGPT_MIN(i00 + split->dc, split->nc),
+  };
+}
+
+typedef void (*sgpt_kernel_t)(const sgpt_compute_params* params,
+                              sgpt_tensor* dst);
+
+// The layout of a copy once the dimensions that are contiguous in both tensors
+// are merged. Dimensions of size 1 are dropped, the unused ones have size 1.
+typedef struct sgpt_copy_layout {
+  int64_t ne[SGPT_MAX_DIMS];
+  size_t nbs[SGPT_MAX_DIMS];  // strides of the source
+  size_t nbd[SGPT_MAX_DIMS];  // strides of the destination
+} sgpt_copy_layout;
+
+static sgpt_copy_layout sgpt_collapse_dims(const sgpt_tensor* dst,
+                                           const sgpt_tensor* src) {
+  const size_t ts = SGPT_TYPE_SIZE[dst->type];
+  sgpt_copy_layout layout = {
+      .ne = {1, 1, 1, 1},
+      .nbs = {ts, 0, 0, 0},
+      .nbd = {ts, 0, 0, 0},
+  };
+  int n = 0;
+  for (int i = 0; i < SGPT_MAX_DIMS; i++) {
+    // rows of quantized types are copied block by block
+    const int64_t ne =
+        i == 0 ? dst->ne[0] / SGPT_BLCK_SIZE[dst->type] : dst->ne[i];
+    if (ne == 1) continue;
+    if (n > 0 && layout.nbs[n - 1] * layout.ne[n - 1] == src->nb[i] &&
+        layout.nbd[n - 1] * layout.ne[n - 1] == dst->nb[i]) {
+      layout.ne[n - 1] *= ne;
+      continue;
+    }
+    layout.ne[n] = ne;
+    layout.nbs[n] = src->nb[i];
+    layout.nbd[n] = dst->nb[i];
+    n++;
+  }
+  return layout;
+}
+
+static inline void sgpt_copy_element(char* z, const char* x, size_t ts) {
+  switch (ts) {
+    case 4:
+      memcpy(z, x, 4);
+      break;
+    case 2:
+      memcpy(z, x, 2);
+      break;
+    default:
+      memcpy(z, x, ts);
+  }
+}
+
+// Side of the square tiles of a strided copy. A tile of 4 byte elements takes
+// 4 KB in each tensor, so both stay in L1 while it is copied.
+#define SGPT_COPY_TILE 32
+
+// Copies rows that are contiguous in both tensors with one memcpy each. A
+// fully contiguous tensor collapses to a single row whose bytes are divided
+// among the tasks.
+static void sgpt_copy_rows(const sgpt_compute_params* params,
+                           const sgpt_copy_layout* l, char* z, const char* x,
+                           size_t ts) {
+  const int64_t nr = l->ne[1] * l->ne[2] * l->ne[3];
+  const size_t row_size = ts * l->ne[0];
+  int64_t ir0 = 0;
+  int64_t ir1 = nr;
+  size_t b0 = 0;
+  size_t b1 = row_size;
+  if (nr >= params->nth) {
+    const int64_t dr = (nr + params->nth - 1) / params->nth;
+    ir0 = SGPT_MIN(dr * params->ith, nr);
+    ir1 = SGPT_MIN(ir0 + dr, nr);
+  } else {
+    const size_t db = SGPT_PAD((row_size + params->nth - 1) / params->nth, 64);
+    b0 = SGPT_MIN(db * params->ith, row_size);
+    b1 = SGPT_MIN(b0 + db, row_size);
+  }
+  for (int64_t ir = ir0; ir < ir1; ir++) {
+    const int64_t i3 = ir / (l->ne[2] * l->ne[1]);
+    const int64_t i2 = (ir - i3 * l->ne[2] * l->ne[1]) / l->ne[1];
+    const int64_t i1 = ir - i3 * l->ne[2] * l->ne[1] - i2 * l->ne[1];
+    const char* const xr = x + l->nbs[3] * i3 + l->nbs[2] * i2 +
+                           l->nbs[1] * i1;
+    char* const zr = z + l->nbd[3] * i3 + l->nbd[2] * i2 + l->nbd[1] * i1;
+    memcpy(zr + b0, xr + b0, b1 - b0);
+  }
+}
+
+// Copies tensors whose elements are not contiguous in one of them. Dimension
+// 0 is walked together with dimension k, the one with the smallest stride in
+// the source, in square tiles: reads and writes then both go through a few
+// cache lines at a time, which keeps copies of transposed views fast. Tiles
+// that transpose 4 byte elements are done with vector shuffles.
+static void sgpt_copy_tiled(const sgpt_compute_params* params,
+                            const sgpt_copy_layout* l, char* z, const char* x,
+                            size_t ts) {
+  int k = 1;
+  for (int i = 2; i < SGPT_MAX_DIMS; i++) {
+    if (l->ne[i] > 1 && (l->ne[k] == 1 || l->nbs[i] < l->nbs[k])) k = i;
+  }
+  // the two remaining dimensions are looped over outside of the tiles
+  const int a = k == 1 ? 2 : 1;
+  const int b = k == 3 ? 2 : 3;
+  const int64_t n_tiles = (l->ne[k] + SGPT_COPY_TILE - 1) / SGPT_COPY_TILE;
+  const int64_t n_units = l->ne[a] * l->ne[b] * n_tiles;
+  const int64_t du = (n_units + params->nth - 1) / params->nth;
+  const int64_t iu0 = SGPT_MIN(du * params->ith, n_units);
+  const int64_t iu1 = SGPT_MIN(iu0 + du, n_units);
+  // the tile is a plain transpose of rows of 4 byte elements
+  const bool transpose = ts == 4 && l->nbs[k] == 4 && l->nbd[0] == 4;
+  for (int64_t iu = iu0; iu < iu1; iu++) {
+    const int64_t io = iu / n_tiles;
+    const int64_t ik0 = (iu - io * n_tiles) * SGPT_COPY_TILE;
+    const int64_t ik1 = SGPT_MIN(ik0 + SGPT_COPY_TILE, l->ne[k]);
+    const int64_t ia = io % l->ne[a];
+    const int64_t ib = io / l->ne[a];
+    const char* const xo = x + l->nbs[a] * ia + l->nbs[b] * ib;
+    char* const zo = z + l->nbd[a] * ia + l->nbd[b] * ib;
+    for (int64_t i00 = 0; i00 < l->ne[0]; i00 += SGPT_COPY_TILE) {
+      const int64_t i01 = SGPT_MIN(i00 + SGPT_COPY_TILE, l->ne[0]);
+      if (transpose) {
+        sgpt_vec.transpose32(i01 - i00, ik1 - ik0,
+                             zo + l->nbd[0] * i00 + l->nbd[k] * ik0,
+                             l->nbd[k],
+                             xo + l->nbs[0] * i00 + l->nbs[k] * ik0,
+                             l->nbs[0]);
+        continue;
+      }
+      for (int64_t ik = ik0; ik < ik1; ik++) {
+        const char* const xk = xo + l->nbs[k] * ik;
+        char* const zk = zo + l->nbd[k] * ik;
+        for (int64_t i0 = i00; i0 < i01; i0++) {
+          sgpt_copy_element(zk + l->nbd[0] * i0, xk + l->nbs[0] * i0, ts);
+        }
+      }
+    }
+  }
+}
+
+// Copies src0 into dst, which have the same shape and type but may have any
+// strides. Dimensions that are contiguous in both are merged first, so that
+// as many bytes as possible move with each memcpy.
+static void sgpt_compute_forward_dup_same(const sgpt_compute_params* params,
+                                          sgpt_tensor* dst) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  const sgpt_tensor* const src0 = dst->src0;
+  assert(src0->ne[0] == dst->ne[0]);
+  assert(src0->ne[1] == dst->ne[1]);
+  assert(src0->ne[2] == dst->ne[2]);
+  assert(src0->ne[3] == dst->ne[3]);
+  const size_t ts = SGPT_TYPE_SIZE[src0->type];
+  const sgpt_copy_layout layout = sgpt_collapse_dims(dst, src0);
+  if (dst->data == src0->data &&
+      memcmp(layout.nbs, layout.nbd, sizeof(layout.nbs)) == 0) {
+    return;
+  }
+  if (layout.nbs[0] == ts && layout.nbd[0] == ts) {
+    sgpt_copy_rows(params, &layout, dst->data, src0->data, ts);
+  } else {
+    sgpt_copy_tiled(params, &layout, dst->data, src0->data, ts);
+  }
+}
+
+// Elements converted at a time by the kernels that compute in f32. Each block
+// is converted into a stack buffer that stays in L1.
+#define SGPT_F32_BLOCK 1024
+
+// Returns elements [i0, i0 + n) of a row of t as f32, converted into buf
+// unless the row already holds contiguous f32. For quantized types, i0 and n
+// are multiples of the block size.
+static const float* sgpt_load_f32(const sgpt_tensor* t, const char* row,
+                                  int64_t i0, int64_t n, float* buf) {
+  const size_t ts = SGPT_TYPE_SIZE[t->type];
+  const int64_t bs = SGPT_BLCK_SIZE[t->type];
+  assert(i0 % bs == 0 && n % bs == 0);
+  if (t->nb[0] != ts) {
+    for (int64_t i = 0; i < n; i += bs) {
+      sgpt_vec.to_f32[t->type](bs, buf + i, row + t->nb[0] * ((i0 + i) / bs));
+    }
+    return buf;
+  }
+  if (t->type == SGPT_TYPE_F32) return (const float*)row + i0;
+  sgpt_vec.to_f32[t->type](n, buf, row + ts * (i0 / bs));
+  return buf;
+}
+
+// Stores n f32 values into elements [i0, i0 + n) of a row of t.
+static void sgpt_store_f32(const sgpt_tensor* t, char* row, int64_t i0,
+                           int64_t n, const float* x) {
+  const size_t ts = SGPT_TYPE_SIZE[t->type];
+  const int64_t bs = SGPT_BLCK_SIZE[t->type];
+  assert(i0 % bs == 0 && n % bs == 0);
+  if (t->nb[0] != ts) {
+    for (int64_t i = 0; i < n; i += bs) {
+      sgpt_vec.from_f32[t->type](bs, row + t->nb[0] * ((i0 + i) / bs), x + i);
+    }
+    return;
+  }
+  sgpt_vec.from_f32[t->type](n, row + ts * (i0 / bs), x);
+}
+
+// Copies src0 into dst of another type, going through f32.
+static void sgpt_compute_forward_dup_convert(const sgpt_compute_params* params,
+                                             sgpt_tensor* dst) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  const sgpt_tensor* const src0 = dst->src0;
+  assert(sgpt_are_same_shape(src0, dst));
+  const sgpt_work_range wr = sgpt_get_work_range(params);
+  const int64_t ne1 = dst->ne[1];
+  const int64_t ne2 = dst->ne[2];
+  float buf[SGPT_F32_BLOCK];
+  for (int64_t ir = wr.ir0; ir < wr.ir1; ir++) {
+    const int64_t i3 = ir / (ne2 * ne1);
+    const int64_t i2 = (ir - i3 * ne2 * ne1) / ne1;
+    const int64_t i1 = ir - i3 * ne2 * ne1 - i2 * ne1;
+    const char* const x = (const char*)src0->data + src0->nb[3] * i3 +
+                          src0->nb[2] * i2 + src0->nb[1] * i1;
+    char* const z =
+        dst->data + dst->nb[3] * i3 + dst->nb[2] * i2 + dst->nb[1] * i1;
+    for (int64_t i0 = wr.i00; i0 < wr.i01; i0 += SGPT_F32_BLOCK) {
+      const int64_t n = SGPT_MIN(SGPT_F32_BLOCK, wr.i01 - i0);
+      sgpt_store_f32(dst, z, i0, n, sgpt_load_f32(src0, x, i0, n, buf));
+    }
+  }
+}
+
+static sgpt_kernel_t sgpt_get_kernel_dup(const sgpt_tensor* dst) {
+  const sgpt_type type0 = dst->src0->type;
+  if (type0 == dst->type) return sgpt_compute_forward_dup_same;
+  assert(sgpt_vec.to_f32[type0] != NULL);
+  assert(sgpt_vec.from_f32[dst->type] != NULL);
+  return sgpt_compute_forward_dup_convert;
+}
+
+static void sgpt_compute_forward_add_f32(const sgpt_compute_params* params,
+                                         sgpt_tensor* dst) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  const sgpt_tensor* const src0 = dst->src0;
+  const sgpt_tensor* const src1 = dst->src1;
+  assert(src0->ne[0] == dst->ne[0]);
+  assert(src0->ne[1] == dst->ne[1]);
+  assert(src0->ne[2] == dst->ne[2]);
+  assert(src0->ne[3] == dst->ne[3]);
+  assert(sgpt_can_repeat(src1, dst));
+  const sgpt_work_range wr = sgpt_get_work_range(params);
+  const int64_t ne1 = src0->ne[1];
+  const int64_t ne2 = src0->ne[2];
+  const int64_t ne10 = src1->ne[0];
+  for (int64_t ir = wr.ir0; ir < wr.ir1; ir++) {
+    const int64_t i3 = ir / (ne2 * ne1);
+    const int64_t i2 = (ir - i3 * ne2 * ne1) / ne1;
+    const int64_t i1 = ir - i3 * ne2 * ne1 - i2 * ne1;
+    char* const x = src0->data + src0->nb[3] * i3 + src0->nb[2] * i2 +
+                    src0->nb[1] * i1;
+    char* const z =
+        dst->data + dst->nb[3] * i3 + dst->nb[2] * i2 + dst->nb[1] * i1;
+    // the row of src1, which repeats along its dimensions of size 1
+    char* const y = src1->data + src1->nb[3] * (i3 % src1->ne[3]) +
+                    src1->nb[2] * (i2 % src1->ne[2]) +
+                    src1->nb[1] * (i1 % src1->ne[1]);
+    const bool rows =
+        src0->nb[0] == sizeof(float) && dst->nb[0] == sizeof(float);
+    const int64_t n = wr.i01 - wr.i00;
+    if (rows && ne10 == 1) {
+      sgpt_vec.add1_f32(n, (float*)z + wr.i00, (float*)x + wr.i00,
+                        ((float*)y)[0]);
+    } else if (rows && src1->nb[0] == sizeof(float)) {
+      sgpt_vec.add_f32(n, (float*)z + wr.i00, (float*)x + wr.i00,
+                       (float*)y + wr.i00);
+    } else {
+      for (int64_t i0 = wr.i00; i0 < wr.i01; i0++) {
+        ((float*)(z + dst->nb[0] * i0))[0] =
+            ((float*)(x + src0->nb[0] * i0))[0] +
+            ((float*)(y + src1->nb[0] * (i0 % ne10)))[0];
+      }
+    }
+  }
+}
+
+static void sgpt_compute_forward_add_i32(const sgpt_compute_params* params,
+                                         sgpt_tensor* dst) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  const sgpt_tensor* const src0 = dst->src0;
+  const sgpt_tensor* const src1 = dst->src1;
+  assert(src0->ne[0] == dst->ne[0]);
+  assert(src0->ne[1] == dst->ne[1]);
+  assert(src0->ne[2] == dst->ne[2]);
+  assert(src0->ne[3] == dst->ne[3]);
+  assert(sgpt_can_repeat(src1, dst));
+  const sgpt_work_range wr = sgpt_get_work_range(params);
+  const int64_t ne1 = src0->ne[1];
+  const int64_t ne2 = src0->ne[2];
+  const int64_t ne10 = src1->ne[0];
+  for (int64_t ir = wr.ir0; ir < wr.ir1; ir++) {
+    const int64_t i3 = ir / (ne2 * ne1);
+    const int64_t i2 = (ir - i3 * ne2 * ne1) / ne1;
+    const int64_t i1 = ir - i3 * ne2 * ne1 - i2 * ne1;
+    char* const x = src0->data + src0->nb[3] * i3 + src0->nb[2] * i2 +
+                    src0->nb[1] * i1;
+    char* const z =
+        dst->data + dst->nb[3] * i3 + dst->nb[2] * i2 + dst->nb[1] * i1;
+    // the row of src1, which repeats along its dimensions of size 1
+    char* const y = src1->data + src1->nb[3] * (i3 % src1->ne[3]) +
+                    src1->nb[2] * (i2 % src1->ne[2]) +
+                    src1->nb[1] * (i1 % src1->ne[1]);
+    const bool rows =
+        src0->nb[0] == sizeof(int32_t) && dst->nb[0] == sizeof(int32_t);
+    const int64_t n = wr.i01 - wr.i00;
+    if (rows && ne10 == 1) {
+      sgpt_vec.add1_i32(n, (int32_t*)z + wr.i00, (int32_t*)x + wr.i00,
+                        ((int32_t*)y)[0]);
+    } else if (rows && src1->nb[0] == sizeof(int32_t)) {
+      sgpt_vec.add_i32(n, (int32_t*)z + wr.i00, (int32_t*)x + wr.i00,
+                       (int32_t*)y + wr.i00);
+    } else {
+      for (int64_t i0 = wr.i00; i0 < wr.i01; i0++) {
+        ((int32_t*)(z + dst->nb[0] * i0))[0] =
+            ((int32_t*)(x + src0->nb[0] * i0))[0] +
+            ((int32_t*)(y + src1->nb[0] * (i0 % ne10)))[0];
+      }
+    }
+  }
+}
+
+// Adds tensors of any types, accumulating in f32, and converts the sum to the
+// type of dst. src1 is broadcast like in the other add kernels.
+static void sgpt_compute_forward_add_via_f32(const sgpt_compute_params* params,
+                                             sgpt_tensor* dst) {
+  static_assert(SGPT_MAX_DIMS == 4, "SPGT_MAX_DIMS != 4");
+  const sgpt_tensor* const src0 = dst->src0;
+  const sgpt_tensor* const src1 = dst->src1;
+  assert(sgpt_are_same_shape(src0, dst));
+  assert(sgpt_can_repeat(src1, dst));
+  const sgpt_work_range wr = sgpt_get_work_range(params);
+  const int64_t ne1 = src0->ne[1];
+  const int64_t ne2 = src0->ne[2];
+  const int64_t ne10 = src1->ne[0];
+  float sum[SGPT_F32_BLOCK];
+  float buf[SGPT_F32_BLOCK];
+  for (int64_t ir = wr.ir0; ir < wr.ir1; ir++) {
+    const int64_t i3 = ir / (ne2 * ne1);
+    const int64_t i2 = (ir - i3 * ne2 * ne1) / ne1;
+    const int64_t i1 = ir - i3 * ne2 * ne1 - i2 * ne1;
+    const char* const x = (const char*)src0->data + src0->nb[3] * i3 +
+                          src0->nb[2] * i2 + src0->nb[1] * i1;
+    char* const z =
+        dst->data + dst->nb[3] * i3 + dst->nb[2] * i2 + dst->nb[1] * i1;
+    const char* const y = (const char*)src1->data +
+                          src1->nb[3] * (i3 % src1->ne[3]) +
+                          src1->nb[2] * (i2 % src1->ne[2]) +
+                          src1->nb[1] * (i1 % src1->ne[1]);
+    for (int64_t i0 = wr.i00; i0 < wr.i01; i0 += SGPT_F32_BLOCK) {
+      const int64_t n = SGPT_MIN(SGPT_F32_BLOCK, wr.i01 - i0);
+      const float* const xf = sgpt_load_f32(src0, x, i0, n, sum);
+      if (ne10 == 1) {
+        sgpt_vec.add1_f32(n, sum, xf, sgpt_load_f32(src1, y, 0, 1, buf)[0]);
+      } else {
+        sgpt_vec.add_f32(n, sum, xf, sgpt_load_f32(src1, y, i0, n, buf));
+      }
+      sgpt_store_f32(dst, z, i0, n, sum);
+    }
+  }
+}
+
+static sgpt_kernel_t sgpt_get_kernel_add(const sgpt_tensor* dst) {
+  const sgpt_type type0 = dst->src0->type;
+  const sgpt_type type1 = dst->src1->type;
+  const bool same = type0 == dst->type && type1 == dst->type;
+  if (same && dst->type == SGPT_TYPE_F32) {
+    return sgpt_compute_forward_add_f32;
+  }
+  if (same && dst->type == SGPT_TYPE_I32) {
+    return sgpt_compute_forward_add_i32;
+  }
+  assert(sgpt_vec.to_f32[type0] != NULL && sgpt_vec.to_f32[type1] != NULL);
+  assert(sgpt_vec.from_f32[dst->type] != NULL);
+  return sgpt_compute_forward_add_via_f32;
+}
+
+// Elements of a row summed at a time by the kernels of SGPT_OP_ADD_N. The
+// partial sums stay in L1 while every input streams through them, and each
+// block of dst is written once, so dst may overlap any of the inputs.
+#define SGPT_ADD_N_BLOCK 1024
+
+static void sgpt_compute_forward_add_n_f32(const sgpt_compute_params* params,
+                                           sgpt_tensor* dst) {
+  assert(sgpt_is_contiguous(dst));
+  const sgpt_work_range wr = sgpt_get_work_range(params);
+  float sum[SGPT_ADD_N_BLOCK];
+  for (int64_t ir = wr.ir0; ir < wr.ir1; ir++) {
+    for (int64_t i0 = wr.i00; i0 < wr.i01; i0 += SGPT_ADD_N_BLOCK) {
+      const int n = (int)SGPT_MIN(SGPT_ADD_N_BLOCK, wr.i01 - i0);
+      const size_t loc = dst->nb[1] * ir + sizeof(float) * i0;
+      const float* const x = (const float*)(dst->srcs[0]->data + loc);
+      if (dst->n_srcs == 1) {
+        memcpy(sum, x, sizeof(float) * n);
+      } else {
+        sgpt_vec.add_f32(n, sum, (float*)x,
+                         (float*)(dst->srcs[1]->data + loc));
+      }
+      for (int k = 2; k < dst->n_srcs; k++) {
+        sgpt_vec.add_f32(n, sum, sum, (float*)(dst->srcs[k]->data + loc));
+      }
+      memcpy(dst->data + loc, sum, sizeof(float) * n);
+    }
+  }
+}
+
+static void sgpt_compute_forward_add_n_i32(const sgpt_compute_params* params,
+                                           sgpt_tensor* dst) {
+  assert(sgpt_is_contiguous(dst));
+  const sgpt_work_range wr = sgpt_get_work_range(params);
+  int32_t sum[SGPT_ADD_N_BLOCK];
+  for (int64_t ir = wr.ir0; ir < wr.ir1; ir++) {
+    for (int64_t i0 = wr.i00; i0 < wr.i01; i0 += SGPT_ADD_N_BLOCK) {
+      const int n = (int)SGPT_MIN(SGPT_ADD_N_BLOCK, wr.i01 - i0);
+      const size_t loc = dst->nb[1] * ir + sizeof(int32_t) * i0;
+      const int32_t* const x = (const int32_t*)(dst->srcs[0]->data + loc);
+      if (dst->n_srcs == 1) {
+        memcpy(sum, x, sizeof(int32_t) * n);
+      } else {
+        sgpt_vec.add_i32(n, sum, (int32_t*)x,
+                         (int32_t*)(dst->srcs[1]->data + loc));
+      }
+      for (int k = 2; k < dst->n_srcs; k++) {
+        sgpt_vec.add_i32(n, sum, sum, (int32_t*)(dst->srcs[k]->data + loc));
+      }
+      memcpy(dst->data + loc, sum, sizeof(int32_t) * n);
+    }
+  }
+}
+
+static sgpt_kernel_t sgpt_get_kernel_add_n(const sgpt_tensor* dst) {
+  switch (dst->type) {
+    case SGPT_TYPE_F32:
+      return sgpt_compute_forward_add_n_f32;
+    case SGPT_TYPE_I32:
+      return sgpt_compute_forward_add_n_i32;
+    default:
+      assert(false);
+      return NULL;
+  }
+}
+
+static sgpt_kernel_t sgpt_get_kernel(const sgpt_tensor* tensor) {
+  switch (tensor->op) {
+    case SGPT_OP_DUP:
+      return sgpt_get_kernel_dup(tensor);
+    case SGPT_OP_ADD:
+      return sgpt_get_kernel_add(tensor);
+    case SGPT_OP_ADD_N:
+      return sgpt_get_kernel_add_n(tensor);
+    default:
+      assert(false);
+      return NULL;
+  }
+}
+
+// Below this many elements per task, splitting a node costs more in
+// synchronization than it saves.
+#define SGPT_MIN_ELEMENTS_PER_TASK 4096
+
+// A node resolved to its kernel and its division into tasks.
+typedef struct sgpt_plan_node {
+  sgpt_kernel_t kernel;
+  sgpt_tensor* tensor;
+  int n_tasks;
+  sgpt_work_split split;
+} sgpt_plan_node;
+
+static void sgpt_plan_nodes(const sgpt_cgraph* cgraph, int n_threads,
+                            sgpt_plan_node* nodes) {
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    sgpt_tensor* const tensor = cgraph->nodes[i];
+    const int64_t n_tasks = SGPT_MAX(
+        SGPT_MIN(sgpt_nelements(tensor) / SGPT_MIN_ELEMENTS_PER_TASK,
+                 n_threads),
+        1);
+    nodes[i] = (sgpt_plan_node){
+        .kernel = sgpt_get_kernel(tensor),
+        .tensor = tensor,
+        .n_tasks = (int)n_tasks,
+        .split = sgpt_new_work_split(tensor, (int)n_tasks),
+    };
+  }
+}
+
+sgpt_cplan* sgpt_graph_plan(sgpt_context* ctx, const sgpt_cgraph* cgraph) {
+  const size_t nodes_size = sizeof(sgpt_plan_node) * cgraph->n_nodes;
+  sgpt_object* const obj =
+      sgpt_new_object(ctx, SGPT_OBJECT_PLAN, sizeof(sgpt_cplan) + nodes_size);
+  char* const mem = (char*)ctx->mem_buffer + obj->offset;
+  sgpt_cplan* const plan = (sgpt_cplan*)mem;
+  *plan = (sgpt_cplan){
+      .n_threads = ctx->n_threads,
+      .n_nodes = cgraph->n_nodes,
+      .nodes = (sgpt_plan_node*)(mem + sizeof(sgpt_cplan)),
+      .perf = cgraph->perf,
+  };
+  sgpt_plan_nodes(cgraph, plan->n_threads, plan->nodes);
+  return plan;
+}
+
+static void sgpt_compute_plan_node(const sgpt_plan_node* node, int ith) {
+  if (ith >= node->n_tasks) return;
+  const sgpt_compute_params params = {
+      .ith = ith,
+      .nth = node->n_tasks,
+      .split = &node->split,
+  };
+  node->kernel(&params, node->tensor);
+}
+
+// A pool of n_threads - 1 workers that lives as long as its context. The
+// calling thread of sgpt_plan_execute acts as the thread with ith == 0.
+typedef struct sgpt_threadpool {
+  int n_threads;
+  pthread_t* workers;
+  struct sgpt_worker* worker_args;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int generation;  // bumped under mutex each time a new plan is posted
+  bool stop;
+  const sgpt_cplan* plan;
+
+  atomic_int n_barrier;
+  atomic_int n_barrier_passed;
+} sgpt_threadpool;
+
+typedef struct sgpt_worker {
+  sgpt_threadpool* pool;
+  int ith;
+} sgpt_worker;
+
+static void sgpt_barrier(sgpt_threadpool* pool) {
+  if (pool == NULL || pool->n_threads == 1) return;
+  const int n_passed = atomic_load(&pool->n_barrier_passed);
+  if (atomic_fetch_add(&pool->n_barrier, 1) == pool->n_threads - 1) {
+    // last thread to arrive releases the others
+    atomic_store(&pool->n_barrier, 0);
+    atomic_fetch_add(&pool->n_barrier_passed, 1);
+    return;
+  }
+  while (atomic_load(&pool->n_barrier_passed) == n_passed) {
+    sched_yield();
+  }
+}
+
+static inline int64_t sgpt_time_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t sgpt_cycles(void) {
+#if defined(SGPT_X86)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t t;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+#else
+  return 0;
+#endif
+}
+
+static void sgpt_perf_record(sgpt_perf* perf, const sgpt_plan_node* node,
+                             int64_t t_start_ns, int64_t t_ns,
+                             uint64_t cycles) {
+  const sgpt_tensor* const tensor = node->tensor;
+  size_t bytes_read = 0;
+  for (int i = 0; i < sgpt_n_srcs(tensor); i++) {
+    bytes_read += sgpt_nbytes(sgpt_get_src(tensor, i));
+  }
+  // src1 of a copy only orders it after whatever writes the destination
+  if (tensor->op == SGPT_OP_DUP && tensor->src1 != NULL) {
+    bytes_read -= sgpt_nbytes(tensor->src1);
+  }
+  *perf = (sgpt_perf){
+      .t_start_ns = t_start_ns,
+      .t_ns = t_ns,
+      .cycles = cycles,
+      .bytes_read = bytes_read,
+      .bytes_written = sgpt_nbytes(tensor),
+      .n_threads = node->n_tasks,
+  };
+}
+
+// pool is NULL when the calling thread runs the plan alone.
+static void sgpt_plan_execute_thread(sgpt_threadpool* pool,
+                                     const sgpt_cplan* plan, int ith) {
+  // the plan may be gone once the last barrier is passed, so it is not read
+  // again after that
+  const int n_nodes = plan->n_nodes;
+  const sgpt_plan_node* const nodes = plan->nodes;
+  // thread 0 leaves each barrier once every task of the node is done, so it
+  // alone times the nodes
+  sgpt_perf* const perf = ith == 0 ? plan->perf : NULL;
+  const int64_t t_begin = perf != NULL ? sgpt_time_ns() : 0;
+  for (int i = 0; i < n_nodes; i++) {
+    const int64_t t0 = perf != NULL ? sgpt_time_ns() : 0;
+    const uint64_t c0 = perf != NULL ? sgpt_cycles() : 0;
+    sgpt_compute_plan_node(&nodes[i], ith);
+    // every node may read what the previous ones wrote
+    sgpt_barrier(pool);
+    if (perf != NULL) {
+      const uint64_t c1 = sgpt_cycles();
+      sgpt_perf_record(&perf[i], &nodes[i], t0 - t_begin, sgpt_time_ns() - t0,
+                       c1 - c0);
+    }
+  }
+}
+
+static void* sgpt_worker_main(void* arg) {
+  sgpt_worker* const worker = arg;
+  sgpt_threadpool* const pool = worker->pool;
+  int generation = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stop && pool->generation == generation) {
+      pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    if (pool->stop) {
+      pthread_mutex_unlock(&pool->mutex);
+      break;
+    }
+    generation = pool->generation;
+    const sgpt_cplan* const plan = pool->plan;
+    pthread_mutex_unlock(&pool->mutex);
+
+    sgpt_plan_execute_thread(pool, plan, worker->ith);
+  }
+  return NULL;
+}
+
+static sgpt_threadpool* sgpt_threadpool_new(int n_threads) {
+  sgpt_threadpool* const pool = malloc(sizeof(sgpt_threadpool));
+  assert(pool != NULL);
+  *pool = (sgpt_threadpool){
+      .n_threads = n_threads,
+      .workers = malloc(sizeof(pthread_t) * (n_threads - 1)),
+      .worker_args = malloc(sizeof(sgpt_worker) * (n_threads - 1)),
+      .generation = 0,
+      .stop = false,
+      .plan = NULL,
+  };
+  assert(pool->workers != NULL && pool->worker_args != NULL);
+  atomic_init(&pool->n_barrier, 0);
+  atomic_init(&pool->n_barrier_passed, 0);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  for (int i = 0; i < n_threads - 1; i++) {
+    pool->worker_args[i] = (sgpt_worker){.pool = pool, .ith = i + 1};
+    const int rc = pthread_create(&pool->workers[i], NULL, sgpt_worker_main,
+                                  &pool->worker_args[i]);
+    assert(rc == 0);
+    (void)rc;
+  }
+  return pool;
+}
+
+static void sgpt_threadpool_free(sgpt_threadpool* pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int i = 0; i < pool->n_threads - 1; i++) {
+    pthread_join(pool->workers[i], NULL);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->worker_args);
+  free(pool->workers);
+  free(pool);
+}
+
+void sgpt_plan_execute(sgpt_context* ctx, const sgpt_cplan* plan) {
+  assert(plan->n_threads == ctx->n_threads);
+  // without a node there is no barrier to wait for the workers at, which could
+  // still read the plan after it is gone
+  if (plan->n_nodes == 0) return;
+  if (plan->n_threads == 1) {
+    sgpt_plan_execute_thread(NULL, plan, 0);
+    return;
+  }
+
+  if (ctx->threadpool == NULL) {
+    ctx->threadpool = sgpt_threadpool_new(ctx->n_threads);
+  }
+  sgpt_threadpool* const pool = ctx->threadpool;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->plan = plan;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->mutex);
+
+  // the barrier after the last node guarantees the workers are done
+  sgpt_plan_execute_thread(pool, plan, 0);
+}
+
 void sgpt_graph_compute(sgpt_context* ctx, sgpt_cgraph* cgraph) {
+  // a one-off plan that does not take space in the context
+  sgpt_cplan plan = {
+      .n_threads = ctx->n_threads,
+      .n_nodes = cgraph->n_nodes,
+      .nodes = malloc(sizeof(sgpt_plan_node) * cgraph->n_nodes),
+      .perf = cgraph->perf,
+  };
+  assert(plan.nodes != NULL || cgraph->n_nodes == 0);
+  sgpt_plan_nodes(cgraph, plan.n_threads, plan.nodes);
+  sgpt_plan_execute(ctx, &plan);
+  free(plan.nodes);
+}
+
+void sgpt_graph_profile(sgpt_context* ctx, sgpt_cgraph* cgraph) {
+  if (cgraph->perf != NULL) return;
+  const size_t size = sizeof(sgpt_perf) * cgraph->size;
+  sgpt_object* const obj = sgpt_new_object(ctx, SGPT_OBJECT_BUFFER, size);
+  cgraph->perf = (sgpt_perf*)((char*)ctx->mem_buffer + obj->offset);
+  memset(cgraph->perf, 0, size);
+}
+
+typedef struct sgpt_op_summary {
+  sgpt_op op;
+  sgpt_type type;
+  int n_nodes;
+  int64_t t_ns;
+  uint64_t cycles;
+  size_t bytes;
+} sgpt_op_summary;
+
+static int sgpt_op_summary_cmp(const void* a, const void* b) {
+  const int64_t ta = ((const sgpt_op_summary*)a)->t_ns;
+  const int64_t tb = ((const sgpt_op_summary*)b)->t_ns;
+  return (ta < tb) - (ta > tb);
+}
+
+void sgpt_graph_print_profile(const sgpt_cgraph* cgraph, FILE* f) {
+  assert(cgraph->perf != NULL);
+  sgpt_op_summary rows[SGPT_OP_COUNT * SGPT_TYPE_COUNT] = {0};
+  int64_t t_total = 0;
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    const sgpt_tensor* const node = cgraph->nodes[i];
+    const sgpt_perf* const perf = &cgraph->perf[i];
+    sgpt_op_summary* const row = &rows[node->op * SGPT_TYPE_COUNT + node->type];
+    row->op = node->op;
+    row->type = node->type;
+    row->n_nodes++;
+    row->t_ns += perf->t_ns;
+    row->cycles += perf->cycles;
+    row->bytes += perf->bytes_read + perf->bytes_written;
+    t_total += perf->t_ns;
+  }
+  const int n_rows = SGPT_OP_COUNT * SGPT_TYPE_COUNT;
+  qsort(rows, n_rows, sizeof(sgpt_op_summary), sgpt_op_summary_cmp);
+
+  fprintf(f, "%-8s %-6s %8s %12s %7s %14s %10s\n", "op", "type", "nodes",
+          "time (us)", "share", "cycles", "GB/s");
+  for (int i = 0; i < n_rows && rows[i].n_nodes > 0; i++) {
+    const sgpt_op_summary* const row = &rows[i];
+    fprintf(f, "%-8s %-6s %8d %12.1f %6.1f%% %14llu %10.2f\n",
+            SGPT_OP_NAME[row->op], SGPT_TYPE_NAME[row->type], row->n_nodes,
+            row->t_ns / 1e3, t_total > 0 ? 100.0 * row->t_ns / t_total : 0.0,
+            (unsigned long long)row->cycles,
+            row->t_ns > 0 ? (double)row->bytes / row->t_ns : 0.0);
+  }
+  fprintf(f, "%-15s %8d %12.1f\n", "total", cgraph->n_nodes, t_total / 1e3);
+}
+
+bool sgpt_graph_export_trace(const sgpt_cgraph* cgraph, const char* path) {
+  assert(cgraph->perf != NULL);
+  FILE* const f = fopen(path, "w");
+  if (f == NULL) return false;
+  // complete events in microseconds, one track per graph
+  fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    const sgpt_tensor* const node = cgraph->nodes[i];
+    const sgpt_perf* const perf = &cgraph->perf[i];
+    fprintf(f,
+            "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+            "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 0, \"tid\": 0, ",
+            i == 0 ? "" : ",", SGPT_OP_NAME[node->op],
+            SGPT_TYPE_NAME[node->type], perf->t_start_ns / 1e3,
+            perf->t_ns / 1e3);
+    fprintf(f,
+            "\"args\": {\"node\": %d, \"ne\": [%lld, %lld, %lld, %lld], "
+            "\"cycles\": %llu, \"bytes_read\": %zu, \"bytes_written\": %zu, "
+            "\"n_threads\": %d}}",
+            i, (long long)node->ne[0], (long long)node->ne[1],
+            (long long)node->ne[2], (long long)node->ne[3],
+            (unsigned long long)perf->cycles, perf->bytes_read,
+            perf->bytes_written, perf->n_threads);
+  }
+  fprintf(f, "\n]}\n");
+  return fclose(f) == 0;
+}
+
+// Whether the result of t is written over the data of its src0.
+static bool sgpt_is_inplace(const sgpt_tensor* t) {
+  const sgpt_tensor* const src = t->src0;
+  if (src == NULL) return false;
+  if (t->data != NULL) return t->data == src->data;
+  // before the graph is allocated, only in place ops are views of src0
+  const sgpt_tensor* const owner = src->view_src ? src->view_src : src;
+  return t->view_src == owner && t->view_offs == src->view_offs;
+}
+
+// Prints ne, or nb when ne is NULL, separated by sep.
+static void sgpt_dump_sizes(FILE* f, const char* sep, const int64_t* ne,
+                            const size_t* nb) {
+  for (int i = 0; i < SGPT_MAX_DIMS; i++) {
+    fprintf(f, "%s%lld", i > 0 ? sep : "",
+            ne != NULL ? (long long)ne[i] : (long long)nb[i]);
+  }
+}
+
+// Prints the name of a tensor with a backslash before the characters of
+// special, and control characters as JSON escapes.
+static void sgpt_dump_name(FILE* f, const char* name, const char* special) {
+  for (const char* c = name; *c != '\0'; c++) {
+    if ((unsigned char)*c < 0x20) {
+      fprintf(f, "\\u%04x", (unsigned)*c);
+    } else {
+      if (strchr(special, *c) != NULL) fputc('\\', f);
+      fputc(*c, f);
+    }
+  }
+}
+
+#define SGPT_DOT_SPECIAL "\"\\{}|<> "
+
+bool sgpt_graph_dump_dot(const sgpt_cgraph* cgraph, const char* path) {
+  FILE* const f = fopen(path, "w");
+  if (f == NULL) return false;
+  fprintf(f, "digraph sgpt {\n  newrank = true;\n  rankdir = TB;\n");
+  for (int i = 0; i < cgraph->n_leafs; i++) {
+    const sgpt_tensor* const leaf = cgraph->leafs[i];
+    fprintf(f, "  \"%p\" [shape = record, label = \"<x>leaf %d %s ", leaf, i,
+            SGPT_TYPE_NAME[leaf->type]);
+    sgpt_dump_name(f, leaf->name, SGPT_DOT_SPECIAL);
+    fputc('|', f);
+    sgpt_dump_sizes(f, " x ", leaf->ne, NULL);
+    fprintf(f, "|%zu B\"];\n", sgpt_nbytes(leaf));
+  }
+  for (int i = 0; i < cgraph->n_nodes; i++) {
+    const sgpt_tensor* const node = cgraph->nodes[i];
+    const bool inplace = sgpt_is_inplace(node);
+    fprintf(f,
+            "  \"%p\" [shape = record, style = filled, fillcolor = %s, "
+            "label = \"<x>%d %s %s ",
+            node, inplace ? "lightblue" : "white", i, SGPT_OP_NAME[node->op],
+            SGPT_TYPE_NAME[node->type]);
+    sgpt_dump_name(f, node->name, SGPT_DOT_SPECIAL);
+    fputc('|', f);
+    sgpt_dump_sizes(f, " x ", node->ne, NULL);
+    fputs("|nb ", f);
+    sgpt_dump_sizes(f, ", ", NULL, node->nb);
+    fprintf(f, "|%zu B%s", sgpt_nbytes(node), inplace ? ", in place" : "");
+    if (cgraph->perf != NULL) {
+      fprintf(f, "|%.3f us", cgraph->perf[i].t_ns / 1e3);
+    }
+    fprintf(f, "\"];\n");
+    for (int j = 0; j < sgpt_n_srcs(node); j++) {
+      fprintf(f, "  \"%p\":x -> \"%p\":x [label = \"%d\"];\n",
+              (void*)sgpt_get_src(node, j), (void*)node, j);
+    }
+  }
+  fprintf(f, "}\n");
+  return fclose(f) == 0;
+}
+
+static void sgpt_dump_json_tensor(FILE* f, const sgpt_cgraph* cgraph, int i,
+                                  const sgpt_tensor* t) {
+  fprintf(f, "\n    {\"id\": \"%p\", \"name\": \"", (void*)t);
+  sgpt_dump_name(f, t->name, "\"\\");
+  fprintf(f, "\", \"op\": \"%s\", \"type\": \"%s\", ", SGPT_OP_NAME[t->op],
+          SGPT_TYPE_NAME[t->type]);
+  fputs("\"ne\": [", f);
+  sgpt_dump_sizes(f, ", ", t->ne, NULL);
+  fputs("], \"nb\": [", f);
+  sgpt_dump_sizes(f, ", ", NULL, t->nb);
+  fprintf(f, "], \"nbytes\": %zu, \"view\": %s, \"inplace\": %s",
+          sgpt_nbytes(t), t->view_src != NULL ? "true" : "false",
+          sgpt_is_inplace(t) ? "true" : "false");
+  if (t->op != SGPT_OP_NONE) {
+    fputs(", \"srcs\": [", f);
+    for (int j = 0; j < sgpt_n_srcs(t); j++) {
+      fprintf(f, "%s\"%p\"", j > 0 ? ", " : "", (void*)sgpt_get_src(t, j));
+    }
+    fputs("]", f);
+    if (cgraph->perf != NULL) {
+      fprintf(f, ", \"t_ns\": %lld", (long long)cgraph->perf[i].t_ns);
+    }
+  }
+  fputs("}", f);
+}
+
+bool sgpt_graph_dump_json(const sgpt_cgraph* cgraph, const char* path) {
+  FILE* const f = fopen(path, "w");
+  if (f == NULL) return false;
+  fputs("{\n  \"leafs\": [", f);
+  for (int i = 0; i < cgraph->n_leafs; i++) {
+    if (i > 0) fputs(",", f);
+    sgpt_dump_json_tensor(f, cgraph, i, cgraph->leafs[i]);
+  }
+  fputs("\n  ],\n  \"nodes\": [", f);
   for (int i = 0; i < cgraph->n_nodes; i++) {
-    sgpt_compute_forward(cgraph->nodes[i]);
+    if (i > 0) fputs(",", f);
+    sgpt_dump_json_tensor(f, cgraph, i, cgraph->nodes[i]);
+  }
+  fputs("\n  ]\n}\n", f);
+  return fclose(f) == 0;
+}
+
+// Files of sgpt_save start with a header, followed by a table of n_tensors
+// entries. The data of the tensors follows at data_offset, and each tensor
+// starts at an offset into it that is a multiple of alignment. Values are in
+// the byte order of the machine that wrote them.
+#define SGPT_FILE_MAGIC 0x54504753 // "SGPT" in little endian
+#define SGPT_FILE_VERSION 1
+
+typedef struct sgpt_file_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_tensors;
+  uint32_t alignment;
+  uint64_t data_offset;
+  uint64_t data_size;
+} sgpt_file_header;
+
+typedef struct sgpt_file_tensor {
+  char name[SGPT_MAX_NAME];
+  uint32_t type;
+  uint32_t n_dims;
+  int64_t ne[SGPT_MAX_DIMS];
+  uint64_t offset; // from data_offset
+  uint64_t size;
+} sgpt_file_tensor;
+
+bool sgpt_save(const char* path, sgpt_tensor* const* tensors, int n_tensors) {
+  const size_t alignment = SGPT_DEFAULT_DATA_ALIGNMENT;
+  sgpt_file_tensor* const table = calloc(n_tensors, sizeof(sgpt_file_tensor));
+  assert(table != NULL || n_tensors == 0);
+  uint64_t data_size = 0;
+  for (int i = 0; i < n_tensors; i++) {
+    const sgpt_tensor* const tensor = tensors[i];
+    assert(tensor->data != NULL && sgpt_is_contiguous(tensor));
+    sgpt_file_tensor* const entry = &table[i];
+    memcpy(entry->name, tensor->name, SGPT_MAX_NAME);
+    entry->type = tensor->type;
+    entry->n_dims = tensor->n_dims;
+    for (int j = 0; j < SGPT_MAX_DIMS; j++) entry->ne[j] = tensor->ne[j];
+    entry->offset = SGPT_PAD(data_size, alignment);
+    entry->size = sgpt_nbytes(tensor);
+    data_size = entry->offset + entry->size;
+  }
+  const size_t table_end =
+      sizeof(sgpt_file_header) + sizeof(sgpt_file_tensor) * n_tensors;
+  const sgpt_file_header header = {
+      .magic = SGPT_FILE_MAGIC,
+      .version = SGPT_FILE_VERSION,
+      .n_tensors = (uint32_t)n_tensors,
+      .alignment = (uint32_t)alignment,
+      .data_offset = SGPT_PAD(table_end, alignment),
+      .data_size = data_size,
+  };
+
+  FILE* const f = fopen(path, "wb");
+  if (f == NULL) {
+    free(table);
+    return false;
+  }
+  static const char zeros[SGPT_DEFAULT_DATA_ALIGNMENT];
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  ok = ok && fwrite(table, sizeof(sgpt_file_tensor), n_tensors, f) ==
+                 (size_t)n_tensors;
+  uint64_t pos = table_end;
+  for (int i = 0; i < n_tensors && ok; i++) {
+    const uint64_t start = header.data_offset + table[i].offset;
+    ok = fwrite(zeros, 1, start - pos, f) == start - pos;
+    ok = ok && fwrite(tensors[i]->data, 1, table[i].size, f) == table[i].size;
+    pos = start + table[i].size;
+  }
+  free(table);
+  return fclose(f) == 0 && ok;
+}
+
+// Whether the entry describes a tensor that lies within the data section.
+static bool sgpt_file_tensor_valid(const sgpt_file_tensor* entry,
+                                   const sgpt_file_header* header) {
+  if (entry->type >= SGPT_TYPE_COUNT) return false;
+  if (entry->n_dims < 1 || entry->n_dims > SGPT_MAX_DIMS) return false;
+  if (memchr(entry->name, '\0', SGPT_MAX_NAME) == NULL) return false;
+  uint64_t size = SGPT_TYPE_SIZE[entry->type];
+  for (int i = 0; i < SGPT_MAX_DIMS; i++) {
+    const int64_t ne = entry->ne[i];
+    if (ne < 1 || (i >= (int)entry->n_dims && ne != 1)) return false;
+    if (i == 0 && ne % SGPT_BLCK_SIZE[entry->type] != 0) return false;
+    const uint64_t n = i == 0 ? ne / SGPT_BLCK_SIZE[entry->type] : ne;
+    if (size > header->data_size / n) return false;
+    size *= n;
+  }
+  return size == entry->size && entry->offset % header->alignment == 0 &&
+         entry->offset <= header->data_size &&
+         size <= header->data_size - entry->offset;
+}
+
+int sgpt_load(sgpt_context* ctx, const char* path, sgpt_tensor** tensors,
+              int max_tensors) {
+  assert(!ctx->measure);
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(sgpt_file_header)) {
+    close(fd);
+    return -1;
+  }
+  const size_t size = (size_t)st.st_size;
+  // private so that tensors can be written to, pages are only copied then
+  char* const addr =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return -1;
+
+  const sgpt_file_header* const header = (const sgpt_file_header*)addr;
+  const sgpt_file_tensor* const table =
+      (const sgpt_file_tensor*)(addr + sizeof(sgpt_file_header));
+  bool ok = header->magic == SGPT_FILE_MAGIC &&
+            header->version == SGPT_FILE_VERSION &&
+            header->alignment > 0 &&
+            (header->alignment & (header->alignment - 1)) == 0 &&
+            header->n_tensors <= (size - sizeof(sgpt_file_header)) /
+                                     sizeof(sgpt_file_tensor) &&
+            header->data_offset % header->alignment == 0 &&
+            header->data_offset >= sizeof(sgpt_file_header) +
+                                       sizeof(sgpt_file_tensor) *
+                                           (uint64_t)header->n_tensors &&
+            header->data_offset <= size &&
+            header->data_size <= size - header->data_offset &&
+            header->n_tensors <= INT32_MAX;
+  for (uint32_t i = 0; ok && i < header->n_tensors; i++) {
+    ok = sgpt_file_tensor_valid(&table[i], header);
+  }
+  sgpt_mapping* const mapping = ok ? malloc(sizeof(sgpt_mapping)) : NULL;
+  if (mapping == NULL) {
+    munmap(addr, size);
+    return -1;
+  }
+  *mapping = (sgpt_mapping){.addr = addr, .size = size, .next = ctx->mappings};
+  ctx->mappings = mapping;
+
+  char* const data = addr + header->data_offset;
+  for (uint32_t i = 0; i < header->n_tensors; i++) {
+    const sgpt_file_tensor* const entry = &table[i];
+    sgpt_tensor* const tensor =
+        sgpt_new_tensor_impl(ctx, entry->type, entry->n_dims, entry->ne, NULL,
+                             0, data + entry->offset);
+    sgpt_set_name(ctx, tensor, entry->name);
+    if ((int)i < max_tensors) tensors[i] = tensor;
   }
+  return (int)header->n_tensors;
 }
@@ -1,10 +1,13 @@
 #include "sgpt.h"
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include "acutest.h"
 
 void test_init(void) {
   uint8_t mem_buffer[8];
-  const sgpt_context* ctx = sgpt_init((sgpt_init_params){
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
       .mem_size = 8,
       .mem_buffer = (void*)mem_buffer,
   });
@@ -13,6 +16,145 @@ void test_init(void) {
   TEST_CHECK(ctx->n_objects == 0);
   TEST_CHECK(ctx->objects_begin == NULL);
   TEST_CHECK(ctx->objects_end == NULL);
+  sgpt_free(ctx);
+}
+
+void test_init_independent(void) {
+  uint8_t mem_buffer0[4096];
+  uint8_t mem_buffer1[4096];
+  sgpt_context* ctx0 = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer0,
+  });
+  sgpt_context* ctx1 = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer1,
+  });
+  TEST_CHECK(ctx0 != ctx1);
+  TEST_CHECK(ctx0->mem_buffer == mem_buffer0);
+  TEST_CHECK(ctx1->mem_buffer == mem_buffer1);
+
+  sgpt_new_tensor_1d(ctx0, SGPT_TYPE_I32, 1);
+  TEST_CHECK(ctx0->n_objects == 1);
+  TEST_CHECK(ctx1->n_objects == 0);
+
+  // a new context on the buffer of a freed one starts empty
+  sgpt_free(ctx0);
+  sgpt_context* ctx2 = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer0,
+  });
+  TEST_CHECK(ctx2->mem_buffer == mem_buffer0);
+  TEST_CHECK(ctx2->n_objects == 0);
+  sgpt_free(ctx2);
+  sgpt_free(ctx1);
+}
+
+static void* run_add_in_own_context(void* arg) {
+  const int32_t offset = *(const int32_t*)arg;
+  uint8_t mem_buffer[4096];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer,
+  });
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 16);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 16);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 4);
+  sgpt_build_forward_expand(gf, c);
+
+  bool ok = true;
+  for (int step = 0; step < 1000; step++) {
+    for (int i = 0; i < 16; i++) {
+      sgpt_set_i32_1d(a, i, offset + i);
+      sgpt_set_i32_1d(b, i, step);
+    }
+    sgpt_graph_compute(ctx, gf);
+    for (int i = 0; i < 16; i++) {
+      ok = ok && sgpt_get_i32_1d(c, i) == offset + i + step;
+    }
+  }
+  sgpt_free(ctx);
+  return ok ? arg : NULL;
+}
+
+void test_init_parallel(void) {
+  pthread_t threads[4];
+  int32_t offsets[4];
+  for (int i = 0; i < 4; i++) {
+    offsets[i] = 1000 * i;
+    pthread_create(&threads[i], NULL, run_add_in_own_context, &offsets[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    void* result = NULL;
+    pthread_join(threads[i], &result);
+    TEST_CHECK_(result == &offsets[i], "thread %d", i);
+  }
+}
+
+void test_init_many(void) {
+  // there is no limit on the number of live contexts
+  enum { n = 200 };
+  sgpt_context* ctxs[n];
+  sgpt_tensor* tensors[n];
+  for (int i = 0; i < n; i++) {
+    ctxs[i] = sgpt_init((sgpt_init_params){
+        .mem_size = 1024,
+        .mem_buffer = NULL,
+    });
+    TEST_ASSERT(ctxs[i] != NULL);
+    tensors[i] = sgpt_new_tensor_1d(ctxs[i], SGPT_TYPE_I32, 1);
+    sgpt_set_i32_1d(tensors[i], 0, i);
+  }
+  bool ok = true;
+  for (int i = 0; i < n; i++) ok = ok && sgpt_get_i32_1d(tensors[i], 0) == i;
+  TEST_CHECK(ok);
+  for (int i = 0; i < n; i++) sgpt_free(ctxs[i]);
+}
+
+void test_init_owned_buffer(void) {
+  const sgpt_init_params params[] = {
+      {.mem_size = 4096},
+      {.mem_size = 3 * 1024 * 1024,
+       .mem_hugepages = true,
+       .mem_populate = true},
+      {.mem_size = 4096, .mem_populate = true, .mem_lock = true},
+      // aligned beyond a page, like the posix_memalign path
+      {.mem_size = 1 << 20, .mem_populate = true, .data_alignment = 1 << 16},
+  };
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    sgpt_context* ctx = sgpt_init(params[i]);
+    TEST_CHECK(ctx->mem_buffer != NULL);
+    TEST_CHECK(ctx->mem_buffer_owned);
+    TEST_CHECK((ctx->mem_mapped_size > 0) == (i > 0));
+    TEST_CHECK(i == 0 || ctx->mem_mapped_size >= ctx->mem_size);
+    // the kernel may refuse either, but neither is granted unasked
+    TEST_CHECK(!ctx->mem_hugepages || params[i].mem_hugepages);
+    TEST_CHECK(!ctx->mem_locked || params[i].mem_lock);
+    TEST_CHECK((uintptr_t)ctx->mem_buffer % ctx->data_alignment == 0);
+
+    sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
+    sgpt_tensor* b = sgpt_add(ctx, a, a);
+    sgpt_cgraph* gf = sgpt_new_graph(ctx, 4);
+    sgpt_build_forward_expand(gf, b);
+    sgpt_set_i32_1d(a, 0, 1);
+    sgpt_set_i32_1d(a, 1, 2);
+    sgpt_graph_compute(ctx, gf);
+    TEST_CHECK(sgpt_get_i32_1d(b, 0) == 2);
+    TEST_CHECK(sgpt_get_i32_1d(b, 1) == 4);
+    sgpt_free(ctx);
+  }
+}
+
+void test_init_alloc_failure(void) {
+  // no system has this much memory, whether it is mapped or not
+  const sgpt_init_params params[] = {
+      {.mem_size = (size_t)1 << 62},
+      {.mem_size = (size_t)1 << 62, .mem_populate = true},
+  };
+  for (size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+    TEST_CHECK(sgpt_init(params[i]) == NULL);
+  }
 }
 
 void test_new_tensor(void) {
@@ -65,6 +207,118 @@ void test_new_tensor(void) {
   TEST_CHECK(a4->nb[1] == 8);
   TEST_CHECK(a4->nb[2] == 24);
   TEST_CHECK(a4->nb[3] == 120);
+  sgpt_free(ctx);
+}
+
+void test_new_tensor_aligned(void) {
+  _Alignas(64) uint8_t mem_buffer[4096];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096 - 16,
+      .mem_buffer = (void*)(mem_buffer + 16),  // not 64 byte aligned
+  });
+  TEST_CHECK(ctx->data_alignment == SGPT_DEFAULT_DATA_ALIGNMENT);
+  for (int i = 1; i < 8; i++) {
+    const sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, i);
+    TEST_CHECK((uintptr_t)a->data % SGPT_DEFAULT_DATA_ALIGNMENT == 0);
+    TEST_CHECK((char*)a->data ==
+               (char*)(a + 1) + ctx->objects_end->padding);
+  }
+  sgpt_free(ctx);
+
+  ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer,
+      .data_alignment = 256,
+  });
+  for (int i = 1; i < 8; i++) {
+    const sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, i);
+    TEST_CHECK((uintptr_t)a->data % 256 == 0);
+  }
+  sgpt_free(ctx);
+}
+
+void test_rollback(void) {
+  uint8_t mem_buffer[4096];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer,
+  });
+
+  const sgpt_arena_mark empty = sgpt_mark(ctx);
+  TEST_CHECK(empty.n_objects == 0);
+  TEST_CHECK(empty.objects_end == NULL);
+  TEST_CHECK(empty.offset == 0);
+
+  sgpt_tensor* w = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
+  sgpt_set_i32_1d(w, 0, 10);
+  sgpt_set_i32_1d(w, 1, 20);
+  const sgpt_arena_mark mark = sgpt_mark(ctx);
+  TEST_CHECK(mark.n_objects == 1);
+  TEST_CHECK(mark.objects_end == ctx->objects_end);
+
+  // the same request twice must land on the same memory
+  sgpt_tensor* outs[2];
+  for (int step = 0; step < 2; step++) {
+    sgpt_tensor* x = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
+    sgpt_tensor* y = sgpt_add(ctx, w, x);
+    sgpt_cgraph* gf = sgpt_new_graph(ctx, 4);
+    sgpt_build_forward_expand(gf, y);
+    sgpt_set_i32_1d(x, 0, step);
+    sgpt_set_i32_1d(x, 1, step);
+    sgpt_graph_compute(ctx, gf);
+    TEST_CHECK(sgpt_get_i32_1d(y, 0) == 10 + step);
+    TEST_CHECK(sgpt_get_i32_1d(y, 1) == 20 + step);
+    outs[step] = y;
+
+    sgpt_rollback(ctx, mark);
+    TEST_CHECK(ctx->n_objects == 1);
+    TEST_CHECK(ctx->objects_end == mark.objects_end);
+    TEST_CHECK(ctx->objects_end->next == NULL);
+  }
+  TEST_CHECK(outs[0] == outs[1]);
+  TEST_CHECK(sgpt_get_i32_1d(w, 0) == 10);
+
+  sgpt_rollback(ctx, empty);
+  TEST_CHECK(ctx->n_objects == 0);
+  TEST_CHECK(ctx->objects_begin == NULL);
+  TEST_CHECK(ctx->objects_end == NULL);
+  sgpt_free(ctx);
+}
+
+static sgpt_tensor* build_measure_graph(sgpt_context* ctx) {
+  sgpt_tensor* a = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 5, 3);
+  sgpt_tensor* b = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 5, 3);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_add_inplace(ctx, c, sgpt_dup(ctx, a));
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d);
+  return d;
+}
+
+void test_measure(void) {
+  uint8_t mem_buffer[4096];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer,
+      .measure = true,
+  });
+  const sgpt_tensor* d = build_measure_graph(ctx);
+  TEST_CHECK(d->data == NULL);
+  TEST_CHECK(d->view_src != NULL);
+  const size_t mem_needed = sgpt_used_mem(ctx);
+  TEST_CHECK(mem_needed > sgpt_mark(ctx).offset);
+  sgpt_free(ctx);
+
+  // a context of exactly the measured size fits the same graph
+  ctx = sgpt_init((sgpt_init_params){
+      .mem_size = mem_needed,
+      .mem_buffer = NULL,
+  });
+  d = build_measure_graph(ctx);
+  TEST_CHECK(d->data != NULL);
+  TEST_CHECK(sgpt_used_mem(ctx) == mem_needed);
+  TEST_CHECK(sgpt_mark(ctx).offset == mem_needed);
+  sgpt_free(ctx);
 }
 
 void test_set_i32(void) {
@@ -141,12 +395,13 @@ void test_set_i32(void) {
       }
     }
   }
+  sgpt_free(ctx);
 }
 
 void test_dup_tensor(void) {
-  uint8_t mem_buffer[1024];
+  uint8_t mem_buffer[4096];
   sgpt_context* ctx = sgpt_init((sgpt_init_params){
-      .mem_size = 1024,
+      .mem_size = 4096,
       .mem_buffer = (void*)mem_buffer,
   });
   const sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 4);
@@ -160,12 +415,13 @@ void test_dup_tensor(void) {
   TEST_CHECK(b->nb[1] == 16);
   TEST_CHECK(b->nb[2] == 16);
   TEST_CHECK(b->nb[3] == 16);
+  sgpt_free(ctx);
 }
 
 void test_view_tensor(void) {
-  uint8_t mem_buffer[1024];
+  uint8_t mem_buffer[4096];
   sgpt_context* ctx = sgpt_init((sgpt_init_params){
-      .mem_size = 1024,
+      .mem_size = 4096,
       .mem_buffer = (void*)mem_buffer,
   });
 
@@ -186,50 +442,177 @@ void test_view_tensor(void) {
   TEST_CHECK(a->data == b->data);
   TEST_CHECK(sgpt_get_i32_1d(b, 0) == 2);
   TEST_CHECK(sgpt_get_i32_1d(b, 1) == 3);
+  sgpt_free(ctx);
+}
+
+void test_view_strided(void) {
+  uint8_t mem_buffer[8192];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(mem_buffer),
+      .mem_buffer = (void*)mem_buffer,
+  });
+
+  // a[i1][i0] = 10 i1 + i0
+  sgpt_tensor* a = sgpt_new_tensor_2d(ctx, SGPT_TYPE_I32, 6, 4);
+  for (int i1 = 0; i1 < 4; i1++) {
+    for (int i0 = 0; i0 < 6; i0++) sgpt_set_i32_2d(a, i0, i1, 10 * i1 + i0);
+  }
+
+  // columns 1..3 of rows 1..2
+  sgpt_tensor* v = sgpt_view_2d(ctx, a, 3, 2, a->nb[1], a->nb[1] + a->nb[0]);
+  TEST_CHECK(v->view_src == a);
+  TEST_CHECK(sgpt_get_i32_2d(v, 0, 0) == 11);
+  TEST_CHECK(sgpt_get_i32_2d(v, 2, 1) == 23);
+  sgpt_tensor* vv = sgpt_view_1d(ctx, v, 2, v->nb[1]);
+  TEST_CHECK(vv->view_src == a);
+  TEST_CHECK(sgpt_get_i32_1d(vv, 1) == 22);
+
+  sgpt_tensor* t = sgpt_transpose(ctx, a);
+  TEST_CHECK(t->ne[0] == 4 && t->ne[1] == 6);
+  TEST_CHECK(t->nb[0] == a->nb[1] && t->nb[1] == a->nb[0]);
+  TEST_CHECK(t->data == a->data);
+  TEST_CHECK(sgpt_get_i32_2d(t, 3, 5) == 35);
+  // a transposed view spans exactly the data of a
+  TEST_CHECK(sgpt_nbytes(t) == sgpt_nbytes(a));
+  TEST_CHECK(sgpt_nbytes(t) == 6 * 4 * sizeof(int32_t));
+  TEST_CHECK(sgpt_nbytes(v) == (3 + 6) * sizeof(int32_t));
+
+  sgpt_tensor* r = sgpt_reshape_3d(ctx, a, 3, 2, 4);
+  TEST_CHECK(r->data == a->data);
+  TEST_CHECK(sgpt_get_i32_3d(r, 2, 1, 3) == 35);
+  sgpt_tensor* p = sgpt_permute(ctx, r, 2, 0, 1, 3);
+  TEST_CHECK(p->ne[0] == 2 && p->ne[1] == 4 && p->ne[2] == 3);
+  TEST_CHECK(sgpt_get_i32_3d(p, 1, 3, 2) == 35);
+  TEST_CHECK(sgpt_nbytes(p) == sgpt_nbytes(a));
+
+  // kernels read and write through the strides of every tensor
+  sgpt_tensor* d = sgpt_dup(ctx, t);
+  sgpt_tensor* b = sgpt_new_tensor_2d(ctx, SGPT_TYPE_I32, 4, 6);
+  for (int i1 = 0; i1 < 6; i1++) {
+    for (int i0 = 0; i0 < 4; i0++) sgpt_set_i32_2d(b, i0, i1, 1000);
+  }
+  sgpt_tensor* s = sgpt_add(ctx, b, t);
+  sgpt_tensor* w = sgpt_add_inplace(ctx, v, sgpt_view_1d(ctx, b, 3, 0));
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d);
+  sgpt_build_forward_expand(gf, s);
+  sgpt_build_forward_expand(gf, w);
+  sgpt_graph_compute(ctx, gf);
+
+  bool ok = true;
+  for (int i1 = 0; i1 < 6; i1++) {
+    for (int i0 = 0; i0 < 4; i0++) {
+      ok = ok && sgpt_get_i32_2d(d, i0, i1) == 10 * i0 + i1;
+      ok = ok && sgpt_get_i32_2d(s, i0, i1) == 1000 + 10 * i0 + i1;
+    }
+  }
+  TEST_CHECK(ok);
+  TEST_CHECK(sgpt_get_i32_2d(a, 0, 0) == 0);
+  TEST_CHECK(sgpt_get_i32_2d(a, 1, 1) == 1011);
+  TEST_CHECK(sgpt_get_i32_2d(a, 3, 2) == 1023);
+  TEST_CHECK(sgpt_get_i32_2d(a, 4, 2) == 24);
+  sgpt_free(ctx);
 }
 
 void test_dup(void) {
-  uint8_t mem_buffer[1024];
+  uint8_t mem_buffer[4096];
   sgpt_context* ctx = sgpt_init((sgpt_init_params){
-      .mem_size = 1024,
+      .mem_size = 4096,
       .mem_buffer = (void*)mem_buffer,
   });
 
   sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
   sgpt_tensor* b = sgpt_dup(ctx, a);
 
-  sgpt_cgraph gf = sgpt_build_forward(b);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, b);
   sgpt_set_i32_1d(a, 0, 1);
   sgpt_set_i32_1d(a, 1, 2);
-  sgpt_graph_compute(ctx, &gf);
+  sgpt_graph_compute(ctx, gf);
 
   TEST_CHECK(sgpt_get_i32_1d(b, 0) == 1);
   TEST_CHECK(sgpt_get_i32_1d(b, 1) == 2);
+  sgpt_free(ctx);
+}
+
+void test_dup_strided(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 512 * 1024,
+      .mem_buffer = NULL,
+      .n_threads = 3,
+  });
+
+  const int ne[4] = {70, 3, 45, 2};
+  sgpt_tensor* a = sgpt_new_tensor_4d(ctx, SGPT_TYPE_I32, ne[0], ne[1], ne[2],
+                                      ne[3]);
+  int32_t* a_data = a->data;
+  for (int i = 0; i < ne[0] * ne[1] * ne[2] * ne[3]; i++) a_data[i] = i;
+
+  // rows 1 and 2 of every matrix are contiguous blocks of 2 rows
+  sgpt_tensor* rows = sgpt_view_4d(ctx, a, ne[0], 2, ne[2], ne[3], a->nb[1],
+                                   a->nb[2], a->nb[3], a->nb[1]);
+  sgpt_tensor* p = sgpt_permute(ctx, a, 2, 0, 3, 1);
+  sgpt_tensor* t =
+      sgpt_transpose(ctx, sgpt_reshape_2d(ctx, a, 210, 90));
+  sgpt_tensor* d_rows = sgpt_dup(ctx, rows);
+  sgpt_tensor* d_p = sgpt_dup(ctx, p);
+  sgpt_tensor* d_t = sgpt_dup(ctx, t);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d_rows);
+  sgpt_build_forward_expand(gf, d_p);
+  sgpt_build_forward_expand(gf, d_t);
+  sgpt_graph_compute(ctx, gf);
+
+  bool ok = true;
+  for (int i3 = 0; i3 < ne[3]; i3++) {
+    for (int i2 = 0; i2 < ne[2]; i2++) {
+      for (int i1 = 0; i1 < ne[1]; i1++) {
+        for (int i0 = 0; i0 < ne[0]; i0++) {
+          const int32_t v = sgpt_get_i32_4d(a, i0, i1, i2, i3);
+          ok = ok && sgpt_get_i32_4d(d_p, i1, i3, i0, i2) == v;
+          if (i1 > 0) {
+            ok = ok && sgpt_get_i32_4d(d_rows, i0, i1 - 1, i2, i3) == v;
+          }
+        }
+      }
+    }
+  }
+  TEST_CHECK(ok);
+  ok = true;
+  for (int i1 = 0; i1 < 210; i1++) {
+    for (int i0 = 0; i0 < 90; i0++) {
+      ok = ok && sgpt_get_i32_2d(d_t, i0, i1) == i0 * 210 + i1;
+    }
+  }
+  TEST_CHECK(ok);
+  sgpt_free(ctx);
 }
 
 void test_dup_inplace(void) {
-  uint8_t mem_buffer[1024];
+  uint8_t mem_buffer[4096];
   sgpt_context* ctx = sgpt_init((sgpt_init_params){
-      .mem_size = 1024,
+      .mem_size = 4096,
       .mem_buffer = (void*)mem_buffer,
   });
 
   sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
   sgpt_tensor* b = sgpt_dup_inplace(ctx, a);
 
-  sgpt_cgraph gf = sgpt_build_forward(b);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, b);
   sgpt_set_i32_1d(a, 0, 1);
   sgpt_set_i32_1d(a, 1, 2);
-  sgpt_graph_compute(ctx, &gf);
+  sgpt_graph_compute(ctx, gf);
 
   TEST_CHECK(sgpt_get_i32_1d(b, 0) == 1);
   TEST_CHECK(sgpt_get_i32_1d(b, 1) == 2);
+  sgpt_free(ctx);
 }
 
 void test_add(void) {
-  uint8_t mem_buffer[1024];
+  uint8_t mem_buffer[4096];
   sgpt_context* ctx = sgpt_init((sgpt_init_params){
-      .mem_size = 1024,
+      .mem_size = 4096,
       .mem_buffer = (void*)mem_buffer,
   });
 
@@ -237,21 +620,23 @@ void test_add(void) {
   sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
   sgpt_tensor* c = sgpt_add(ctx, a, b);
 
-  sgpt_cgraph gf = sgpt_build_forward(c);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, c);
   sgpt_set_i32_1d(a, 0, 1);
   sgpt_set_i32_1d(a, 1, 2);
   sgpt_set_i32_1d(b, 0, 3);
   sgpt_set_i32_1d(b, 1, 4);
-  sgpt_graph_compute(ctx, &gf);
+  sgpt_graph_compute(ctx, gf);
 
   TEST_CHECK(sgpt_get_i32_1d(c, 0) == 1 + 3);
   TEST_CHECK(sgpt_get_i32_1d(c, 1) == 2 + 4);
+  sgpt_free(ctx);
 }
 
 void test_add_inplace(void) {
-  uint8_t mem_buffer[1024];
+  uint8_t mem_buffer[4096];
   sgpt_context* ctx = sgpt_init((sgpt_init_params){
-      .mem_size = 1024,
+      .mem_size = 4096,
       .mem_buffer = (void*)mem_buffer,
   });
 
@@ -259,26 +644,974 @@ void test_add_inplace(void) {
   sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 2);
   sgpt_tensor* c = sgpt_add_inplace(ctx, a, b);
 
-  sgpt_cgraph gf = sgpt_build_forward(c);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, c);
   sgpt_set_i32_1d(a, 0, 1);
   sgpt_set_i32_1d(a, 1, 2);
   sgpt_set_i32_1d(b, 0, 3);
   sgpt_set_i32_1d(b, 1, 4);
-  sgpt_graph_compute(ctx, &gf);
+  sgpt_graph_compute(ctx, gf);
 
   TEST_CHECK(sgpt_get_i32_1d(c, 0) == 1 + 3);
   TEST_CHECK(sgpt_get_i32_1d(c, 1) == 2 + 4);
+  sgpt_free(ctx);
+}
+
+void test_build_forward(void) {
+  uint8_t mem_buffer[4096];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer,
+  });
+
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_add(ctx, c, c);
+  sgpt_tensor* e = sgpt_add(ctx, d, c);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, e);
+  TEST_CHECK(gf->n_nodes == 3);
+  TEST_CHECK(gf->nodes[0] == c);
+  TEST_CHECK(gf->nodes[1] == d);
+  TEST_CHECK(gf->nodes[2] == e);
+  TEST_CHECK(gf->n_leafs == 2);
+  TEST_CHECK(gf->leafs[0] == a);
+  TEST_CHECK(gf->leafs[1] == b);
+  sgpt_free(ctx);
+}
+
+void test_build_forward_deep(void) {
+  // deep enough to overflow the C stack with a recursive traversal
+  const int n_steps = 100000;
+  const size_t mem_size = 64 * 1024 * 1024;
+  void* mem_buffer = malloc(mem_size);
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = mem_size,
+      .mem_buffer = mem_buffer,
+  });
+
+  sgpt_tensor** sums = malloc(sizeof(sgpt_tensor*) * n_steps);
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* x = a;
+  for (int i = 0; i < n_steps; i++) {
+    x = i % 2 == 0 ? sgpt_add(ctx, x, b) : sgpt_add_inplace(ctx, x, b);
+    sums[i] = x;
+  }
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, n_steps);
+  sgpt_build_forward_expand(gf, x);
+  TEST_CHECK(gf->n_nodes == n_steps);
+  TEST_CHECK(gf->n_leafs == 2);
+  TEST_CHECK(gf->leafs[0] == a);
+  TEST_CHECK(gf->leafs[1] == b);
+  for (int i = 0; i < n_steps; i++) {
+    TEST_CHECK_(gf->nodes[i] == sums[i], "nodes[%d]", i);
+  }
+
+  sgpt_set_i32_1d(a, 0, 1);
+  sgpt_set_i32_1d(b, 0, 2);
+  sgpt_graph_compute(ctx, gf);
+  TEST_CHECK(sgpt_get_i32_1d(x, 0) == 1 + 2 * n_steps);
+
+  // sgpt_build_forward sizes its graph to fit, beyond any default size
+  sgpt_cgraph* gb = sgpt_build_forward(ctx, x);
+  TEST_CHECK(gb->size == n_steps + 2);
+  TEST_CHECK(gb->n_nodes == n_steps && gb->n_leafs == 2);
+
+  sgpt_free(ctx);
+  free(sums);
+  free(mem_buffer);
+}
+
+void test_graph_reset(void) {
+  uint8_t mem_buffer[4096];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 4096,
+      .mem_buffer = (void*)mem_buffer,
+  });
+
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_dup(ctx, b);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 4);
+  sgpt_build_forward_expand(gf, c);
+  TEST_CHECK(gf->n_nodes == 1);
+  TEST_CHECK(gf->n_leafs == 2);
+
+  sgpt_graph_reset(gf);
+  TEST_CHECK(gf->n_nodes == 0);
+  TEST_CHECK(gf->n_leafs == 0);
+  sgpt_build_forward_expand(gf, d);
+  TEST_CHECK(gf->n_nodes == 1);
+  TEST_CHECK(gf->nodes[0] == d);
+  TEST_CHECK(gf->n_leafs == 1);
+  TEST_CHECK(gf->leafs[0] == b);
+
+  sgpt_build_forward_expand(gf, c);
+  TEST_CHECK(gf->n_nodes == 2);
+  TEST_CHECK(gf->nodes[1] == c);
+  TEST_CHECK(gf->n_leafs == 2);
+  TEST_CHECK(gf->leafs[1] == a);
+  sgpt_free(ctx);
+}
+
+void test_graph_alloc(void) {
+  static uint8_t meta_buffer[16384];
+  sgpt_context* meta = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(meta_buffer),
+      .mem_buffer = (void*)meta_buffer,
+      .measure = true,
+  });
+
+  // ((a + b) + c) + ... can run in the memory of a single intermediate
+  const int n = 256;
+  const size_t nbytes = sizeof(int32_t) * n;
+  sgpt_tensor* leafs[8];
+  for (int i = 0; i < 8; i++) {
+    leafs[i] = sgpt_new_tensor_1d(meta, SGPT_TYPE_I32, n);
+  }
+  sgpt_tensor* x = sgpt_add(meta, leafs[0], leafs[1]);
+  for (int i = 2; i < 8; i++) x = sgpt_add(meta, x, leafs[i]);
+  // y is read twice, so its first reader can not overwrite it
+  sgpt_tensor* y = sgpt_dup(meta, x);
+  sgpt_tensor* t = sgpt_add(meta, y, leafs[0]);
+  sgpt_tensor* z = sgpt_add(meta, t, y);
+
+  sgpt_cgraph* gf = sgpt_new_graph(meta, 32);
+  sgpt_build_forward_expand(gf, z);
+  TEST_CHECK(z->data == NULL);
+
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024,
+      .mem_buffer = NULL,
+  });
+  const size_t size = sgpt_graph_alloc(ctx, gf);
+  TEST_CHECK_(size == (8 + 2) * nbytes, "size %zu", size);
+  TEST_CHECK(x->data != NULL);
+  TEST_CHECK(x->data == gf->nodes[0]->data);
+  TEST_CHECK(y->data == x->data);
+  TEST_CHECK(t->data != y->data);
+  TEST_CHECK(z->data == t->data);
+  TEST_CHECK((uintptr_t)z->data % SGPT_DEFAULT_DATA_ALIGNMENT == 0);
+
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < n; j++) sgpt_set_i32_1d(leafs[i], j, (i + 1) * j);
+  }
+  sgpt_graph_compute(ctx, gf);
+  bool ok = true;
+  for (int j = 0; j < n; j++) {
+    // x = 36 j, z = 2 x + a
+    ok = ok && sgpt_get_i32_1d(z, j) == 2 * 36 * j + j;
+  }
+  TEST_CHECK(ok);
+
+  sgpt_free(ctx);
+  sgpt_free(meta);
+}
+
+void test_graph_alloc_output(void) {
+  static uint8_t meta_buffer[16384];
+  sgpt_context* meta = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(meta_buffer),
+      .mem_buffer = (void*)meta_buffer,
+      .measure = true,
+  });
+
+  const int n = 64;
+  sgpt_tensor* a = sgpt_new_tensor_1d(meta, SGPT_TYPE_I32, n);
+  sgpt_tensor* b = sgpt_new_tensor_1d(meta, SGPT_TYPE_I32, n);
+  sgpt_tensor* c = sgpt_add(meta, a, b);
+  sgpt_tensor* d = sgpt_add(meta, c, b);
+  sgpt_tensor* e = sgpt_add(meta, d, a);
+
+  // d alone could write over c, and e over d once d is read
+  sgpt_cgraph* gf = sgpt_new_graph(meta, 16);
+  sgpt_build_forward_expand(gf, c);
+  sgpt_build_forward_expand(gf, e);
+
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024,
+      .mem_buffer = NULL,
+  });
+  const size_t size = sgpt_graph_alloc(ctx, gf);
+  TEST_CHECK_(size == 4 * sizeof(int32_t) * n, "size %zu", size);
+  TEST_CHECK(d->data != c->data);
+  TEST_CHECK(e->data == d->data);
+
+  for (int j = 0; j < n; j++) {
+    sgpt_set_i32_1d(a, j, 1 + j);
+    sgpt_set_i32_1d(b, j, 10 * j);
+  }
+  sgpt_graph_compute(ctx, gf);
+  bool ok = true;
+  for (int j = 0; j < n; j++) {
+    ok = ok && sgpt_get_i32_1d(c, j) == 1 + 11 * j;
+    ok = ok && sgpt_get_i32_1d(e, j) == 2 + 22 * j;
+  }
+  TEST_CHECK(ok);
+
+  sgpt_free(ctx);
+  sgpt_free(meta);
+}
+
+void test_graph_fuse(void) {
+  static uint8_t meta_buffer[16384];
+  sgpt_context* meta = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(meta_buffer),
+      .mem_buffer = (void*)meta_buffer,
+      .measure = true,
+  });
+
+  // spans several blocks of the fused kernel
+  const int n = 3072;
+  sgpt_tensor* leafs[8];
+  for (int i = 0; i < 8; i++) {
+    leafs[i] = sgpt_new_tensor_1d(meta, SGPT_TYPE_I32, n);
+  }
+  sgpt_tensor* x = sgpt_add(meta, leafs[0], leafs[1]);
+  for (int i = 2; i < 8; i++) x = sgpt_add(meta, x, leafs[i]);
+  // y is read twice, so it is computed while x and t are merged away
+  sgpt_tensor* y = sgpt_dup(meta, x);
+  sgpt_tensor* t = sgpt_add(meta, y, leafs[0]);
+  sgpt_tensor* z = sgpt_add(meta, t, y);
+
+  sgpt_cgraph* gf = sgpt_new_graph(meta, 32);
+  sgpt_build_forward_expand(gf, z);
+  TEST_CHECK(gf->n_nodes == 10);
+  const int n_removed = sgpt_graph_fuse(meta, gf);
+  TEST_CHECK_(n_removed == 8, "n_removed %d", n_removed);
+  TEST_CHECK(gf->n_nodes == 2);
+  TEST_CHECK(gf->nodes[0] == y && gf->nodes[1] == z);
+  TEST_CHECK(y->op == SGPT_OP_ADD_N && y->n_srcs == 8);
+  for (int i = 0; i < 8; i++) TEST_CHECK(y->srcs[i] == leafs[i]);
+  TEST_CHECK(z->op == SGPT_OP_ADD_N && z->n_srcs == 3);
+  TEST_CHECK(z->srcs[0] == y && z->srcs[1] == leafs[0] && z->srcs[2] == y);
+  TEST_CHECK(sgpt_graph_fuse(meta, gf) == 0);
+
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 256 * 1024,
+      .mem_buffer = NULL,
+  });
+  const size_t size = sgpt_graph_alloc(ctx, gf);
+  TEST_CHECK_(size == 10 * sizeof(int32_t) * n, "size %zu", size);
+
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < n; j++) sgpt_set_i32_1d(leafs[i], j, (i + 1) * j);
+  }
+  sgpt_graph_compute(ctx, gf);
+  bool ok = true;
+  for (int j = 0; j < n; j++) {
+    ok = ok && sgpt_get_i32_1d(z, j) == 2 * 36 * j + j;
+  }
+  TEST_CHECK(ok);
+
+  sgpt_free(ctx);
+  sgpt_free(meta);
+}
+
+void test_graph_fuse_output(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024,
+      .mem_buffer = NULL,
+  });
+
+  const int n = 100;
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, n);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, n);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_add(ctx, c, b);
+  sgpt_tensor* e = sgpt_add(ctx, d, a);
+
+  // c is read by d alone but was expanded, so it is kept while d is merged
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 16);
+  sgpt_build_forward_expand(gf, c);
+  sgpt_build_forward_expand(gf, e);
+  sgpt_build_forward_expand(gf, c);
+  TEST_CHECK(gf->n_outputs == 2);
+  TEST_CHECK(sgpt_graph_fuse(ctx, gf) == 1);
+  TEST_CHECK(gf->n_nodes == 2);
+  TEST_CHECK(gf->nodes[0] == c && gf->nodes[1] == e);
+
+  for (int j = 0; j < n; j++) {
+    sgpt_set_i32_1d(a, j, j);
+    sgpt_set_i32_1d(b, j, 1000 * j);
+    sgpt_set_i32_1d(c, j, -1);
+  }
+  sgpt_graph_compute(ctx, gf);
+  bool ok = true;
+  for (int j = 0; j < n; j++) {
+    ok = ok && sgpt_get_i32_1d(c, j) == 1001 * j;
+    ok = ok && sgpt_get_i32_1d(e, j) == 2002 * j;
+  }
+  TEST_CHECK(ok);
+
+  sgpt_graph_reset(gf);
+  TEST_CHECK(gf->n_outputs == 0);
+
+  sgpt_free(ctx);
+}
+
+void test_add_multi_thread(void) {
+  static uint8_t mem_buffer[1024 * 1024];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(mem_buffer),
+      .mem_buffer = (void*)mem_buffer,
+      .n_threads = 4,
+  });
+
+  // large enough to be split by rows and by columns respectively
+  sgpt_tensor* a = sgpt_new_tensor_2d(ctx, SGPT_TYPE_I32, 64, 333);
+  sgpt_tensor* b = sgpt_new_tensor_2d(ctx, SGPT_TYPE_I32, 64, 333);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_dup(ctx, c);
+  sgpt_tensor* e = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 100000);
+  sgpt_tensor* f = sgpt_add_inplace(ctx, e, e);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d);
+  sgpt_cgraph* gf1d = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf1d, f);
+  for (int step = 0; step < 2; step++) {
+    for (int i = 0; i < 64; i++) {
+      for (int j = 0; j < 333; j++) {
+        sgpt_set_i32_2d(a, i, j, i + step);
+        sgpt_set_i32_2d(b, i, j, j * 100);
+      }
+    }
+    for (int i = 0; i < 100000; i++) sgpt_set_i32_1d(e, i, i);
+    sgpt_graph_compute(ctx, gf);
+    sgpt_graph_compute(ctx, gf1d);
+
+    bool ok = true;
+    for (int i = 0; i < 64; i++) {
+      for (int j = 0; j < 333; j++) {
+        ok = ok && sgpt_get_i32_2d(d, i, j) == i + step + j * 100;
+      }
+    }
+    TEST_CHECK(ok);
+    ok = true;
+    for (int i = 0; i < 100000; i++) {
+      ok = ok && sgpt_get_i32_1d(f, i) == 2 * i;
+    }
+    TEST_CHECK(ok);
+  }
+  TEST_CHECK(ctx->threadpool != NULL);
+  sgpt_free(ctx);
+}
+
+void test_plan_execute(void) {
+  static uint8_t mem_buffer[1024 * 1024];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(mem_buffer),
+      .mem_buffer = (void*)mem_buffer,
+      .n_threads = 2,
+  });
+
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 20000);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 20000);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_add(ctx, c, sgpt_dup(ctx, b));
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d);
+  const sgpt_cplan* plan = sgpt_graph_plan(ctx, gf);
+  TEST_CHECK(plan->n_threads == 2);
+  TEST_CHECK(plan->n_nodes == 3);
+
+  for (int step = 0; step < 3; step++) {
+    for (int i = 0; i < 20000; i++) {
+      sgpt_set_i32_1d(a, i, i * step);
+      sgpt_set_i32_1d(b, i, step);
+    }
+    sgpt_plan_execute(ctx, plan);
+    bool ok = true;
+    for (int i = 0; i < 20000; i++) {
+      ok = ok && sgpt_get_i32_1d(d, i) == i * step + 2 * step;
+    }
+    TEST_CHECK_(ok, "step %d", step);
+  }
+  sgpt_free(ctx);
+}
+
+void test_plan_execute_empty(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 1024 * 1024,
+      .mem_buffer = NULL,
+      .n_threads = 8,
+  });
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 20000);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 20000);
+  sgpt_cgraph* empty = sgpt_build_forward(ctx, a);
+  TEST_CHECK(empty->n_nodes == 0 && empty->n_leafs == 1);
+  sgpt_cgraph* gf = sgpt_build_forward(ctx, sgpt_add(ctx, a, b));
+  for (int i = 0; i < 20000; i++) {
+    sgpt_set_i32_1d(a, i, i);
+    sgpt_set_i32_1d(b, i, 1);
+  }
+  // a graph without nodes must not leave the workers behind
+  for (int step = 0; step < 100; step++) {
+    sgpt_graph_compute(ctx, empty);
+    sgpt_graph_compute(ctx, gf);
+  }
+  bool ok = true;
+  sgpt_tensor* c = gf->nodes[0];
+  for (int i = 0; i < 20000; i++) ok = ok && sgpt_get_i32_1d(c, i) == i + 1;
+  TEST_CHECK(ok);
+  sgpt_free(ctx);
+}
+
+void test_graph_profile(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 1024 * 1024,
+      .mem_buffer = NULL,
+      .n_threads = 2,
+  });
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 20000);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 1);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_cast(ctx, sgpt_add(ctx, c, a), SGPT_TYPE_F16);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d);
+  sgpt_graph_compute(ctx, gf);
+  TEST_CHECK(gf->perf == NULL);
+  sgpt_graph_profile(ctx, gf);
+  const sgpt_cplan* plan = sgpt_graph_plan(ctx, gf);
+  sgpt_plan_execute(ctx, plan);
+
+  const size_t nbytes = 20000 * sizeof(float);
+  const sgpt_perf* perf = gf->perf;
+  TEST_CHECK(gf->n_nodes == 3);
+  TEST_CHECK(perf[0].bytes_read == nbytes + sizeof(float));
+  TEST_CHECK(perf[1].bytes_read == 2 * nbytes);
+  TEST_CHECK(perf[2].bytes_read == nbytes);
+  TEST_CHECK(perf[2].bytes_written == nbytes / 2);
+  for (int i = 0; i < gf->n_nodes; i++) {
+    TEST_CHECK(perf[i].n_threads == 2);
+    TEST_CHECK(perf[i].t_ns > 0);
+    if (i > 0) {
+      TEST_CHECK(perf[i].t_start_ns >=
+                 perf[i - 1].t_start_ns + perf[i - 1].t_ns);
+    }
+  }
+
+  FILE* f = tmpfile();
+  sgpt_graph_print_profile(gf, f);
+  char line[256];
+  rewind(f);
+  TEST_CHECK(fgets(line, sizeof(line), f) != NULL);
+  TEST_CHECK(strncmp(line, "op ", 3) == 0);
+  int n_lines = 0;
+  while (fgets(line, sizeof(line), f) != NULL) n_lines++;
+  // ADD f32, DUP f16 and the total
+  TEST_CHECK(n_lines == 3);
+  fclose(f);
+
+  const char* path = "sgpt_test_trace.json";
+  TEST_CHECK(sgpt_graph_export_trace(gf, path));
+  f = fopen(path, "r");
+  TEST_ASSERT(f != NULL);
+  char trace[4096];
+  const size_t n = fread(trace, 1, sizeof(trace) - 1, f);
+  trace[n] = '\0';
+  fclose(f);
+  remove(path);
+  TEST_CHECK(strstr(trace, "\"traceEvents\"") != NULL);
+  TEST_CHECK(strstr(trace, "\"name\": \"DUP\", \"cat\": \"f16\"") != NULL);
+  sgpt_free(ctx);
+}
+
+// Reads the file at path into buf and removes it.
+static size_t read_and_remove(const char* path, char* buf, size_t size) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return 0;
+  const size_t n = fread(buf, 1, size - 1, f);
+  buf[n] = '\0';
+  fclose(f);
+  remove(path);
+  return n;
+}
+
+static int count_substr(const char* s, const char* sub) {
+  int n = 0;
+  for (const char* p = strstr(s, sub); p != NULL; p = strstr(p + 1, sub)) n++;
+  return n;
+}
+
+void test_graph_dump(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024,
+      .mem_buffer = NULL,
+  });
+  sgpt_tensor* a = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 6, 4);
+  sgpt_tensor* b = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 4, 6);
+  sgpt_tensor* c = sgpt_add(ctx, a, sgpt_transpose(ctx, b));
+  sgpt_tensor* d = sgpt_add_inplace(ctx, c, a);
+  sgpt_tensor* e = sgpt_cast(ctx, d, SGPT_TYPE_F16);
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, e);
+  TEST_CHECK(gf->n_nodes == 3 && gf->n_leafs == 2);
+
+  char buf[8192];
+  const char* path = "sgpt_test_graph.json";
+  TEST_CHECK(sgpt_graph_dump_json(gf, path));
+  TEST_ASSERT(read_and_remove(path, buf, sizeof(buf)) > 0);
+  TEST_CHECK(count_substr(buf, "\"op\": \"NONE\"") == 2);
+  TEST_CHECK(count_substr(buf, "\"op\": \"ADD\"") == 2);
+  TEST_CHECK(count_substr(buf, "\"inplace\": true") == 1);
+  TEST_CHECK(count_substr(buf, "\"t_ns\"") == 0);
+  // the transposed view of b is a leaf, followed by the f16 cast
+  TEST_CHECK(strstr(buf, "\"nb\": [16, 4, 96, 96]") != NULL);
+  TEST_CHECK(strstr(buf, "\"nb\": [2, 12, 48, 48]") != NULL);
+
+  sgpt_graph_profile(ctx, gf);
+  sgpt_graph_compute(ctx, gf);
+  path = "sgpt_test_graph.dot";
+  TEST_CHECK(sgpt_graph_dump_dot(gf, path));
+  TEST_ASSERT(read_and_remove(path, buf, sizeof(buf)) > 0);
+  TEST_CHECK(strncmp(buf, "digraph", 7) == 0);
+  TEST_CHECK(count_substr(buf, " -> ") == 5);
+  TEST_CHECK(count_substr(buf, "in place") == 1);
+  TEST_CHECK(count_substr(buf, " us\"") == 3);
+  sgpt_free(ctx);
+}
+
+void test_save_load(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024,
+      .mem_buffer = NULL,
+  });
+  sgpt_tensor* saved[3] = {
+      sgpt_set_name(ctx, sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 5, 3), "w"),
+      sgpt_set_name(ctx, sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 7), "counts"),
+      sgpt_new_tensor_3d(ctx, SGPT_TYPE_Q8_0, SGPT_QK, 2, 2),
+  };
+  TEST_CHECK(strcmp(sgpt_get_name(saved[0]), "w") == 0);
+  TEST_CHECK(sgpt_get_name(saved[2])[0] == '\0');
+  for (int i = 0; i < 3; i++) {
+    uint8_t* data = saved[i]->data;
+    for (size_t j = 0; j < sgpt_row_size(saved[i]->type, saved[i]->ne[0]) *
+                               saved[i]->ne[1] * saved[i]->ne[2];
+         j++) {
+      data[j] = (uint8_t)(j * 31 + i);
+    }
+  }
+  const char* path = "sgpt_test_tensors.bin";
+  TEST_ASSERT(sgpt_save(path, saved, 3));
+
+  sgpt_context* loaded = sgpt_init((sgpt_init_params){
+      .mem_size = 16 * 1024,
+      .mem_buffer = NULL,
+  });
+  sgpt_tensor* tensors[2] = {NULL, NULL};
+  // only the table is copied into the context
+  TEST_CHECK(sgpt_load(loaded, path, tensors, 2) == 3);
+  TEST_CHECK(sgpt_used_mem(loaded) < 4 * 1024);
+  TEST_CHECK(strcmp(sgpt_get_name(tensors[0]), "w") == 0);
+  TEST_CHECK(strcmp(sgpt_get_name(tensors[1]), "counts") == 0);
+  for (int i = 0; i < 2; i++) {
+    TEST_CHECK(tensors[i]->type == saved[i]->type);
+    TEST_CHECK(tensors[i]->n_dims == saved[i]->n_dims);
+    TEST_CHECK(memcmp(tensors[i]->ne, saved[i]->ne, sizeof(saved[i]->ne)) ==
+               0);
+    TEST_CHECK(memcmp(tensors[i]->nb, saved[i]->nb, sizeof(saved[i]->nb)) ==
+               0);
+    TEST_CHECK(memcmp(tensors[i]->data, saved[i]->data,
+                      sgpt_row_size(saved[i]->type, saved[i]->ne[0]) *
+                          saved[i]->ne[1]) == 0);
+    TEST_CHECK((uintptr_t)tensors[i]->data % SGPT_DEFAULT_DATA_ALIGNMENT == 0);
+    TEST_CHECK((char*)tensors[i]->data < (char*)loaded->mem_buffer ||
+               (char*)tensors[i]->data >=
+                   (char*)loaded->mem_buffer + loaded->mem_size);
+  }
+  // writes stay in the process
+  sgpt_set_i32_1d(tensors[1], 0, -1);
+  sgpt_tensor* again[3];
+  TEST_CHECK(sgpt_load(loaded, path, again, 3) == 3);
+  TEST_CHECK(sgpt_get_i32_1d(again[1], 0) == sgpt_get_i32_1d(saved[1], 0));
+  TEST_CHECK(again[2]->type == SGPT_TYPE_Q8_0 && again[2]->ne[2] == 2);
+  TEST_CHECK(sgpt_get_tensor(loaded, "counts") == tensors[1]);
+  TEST_CHECK(memcmp(again[2]->data, saved[2]->data, 4 * 34) == 0);
+
+  // a file cut short is rejected
+  FILE* f = fopen(path, "r+b");
+  TEST_ASSERT(f != NULL);
+  fseek(f, 0, SEEK_END);
+  const long size = ftell(f);
+  fclose(f);
+  TEST_CHECK(truncate(path, size - 1) == 0);
+  TEST_CHECK(sgpt_load(loaded, path, again, 3) == -1);
+  remove(path);
+  TEST_CHECK(sgpt_load(loaded, path, again, 3) == -1);
+  sgpt_free(loaded);
+  sgpt_free(ctx);
+}
+
+void test_named_tensors(void) {
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 1024 * 1024,
+      .mem_buffer = NULL,
+      .measure = true,
+  });
+  TEST_CHECK(sgpt_get_tensor(ctx, "x") == NULL);
+  enum { n = 1000 };
+  sgpt_tensor* tensors[n];
+  char name[SGPT_MAX_NAME];
+  for (int i = 0; i < n / 2; i++) {
+    snprintf(name, sizeof(name), "layer.%d.weight", i);
+    tensors[i] = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 4);
+    sgpt_set_name(ctx, tensors[i], name);
+  }
+  const sgpt_arena_mark mark = sgpt_mark(ctx);
+  // enough names after the mark to grow the index
+  for (int i = n / 2; i < n; i++) {
+    snprintf(name, sizeof(name), "layer.%d.weight", i);
+    tensors[i] = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 4);
+    sgpt_set_name(ctx, tensors[i], name);
+  }
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    snprintf(name, sizeof(name), "layer.%d.weight", i);
+    ok = ok && sgpt_get_tensor(ctx, name) == tensors[i];
+  }
+  TEST_CHECK(ok);
+  TEST_CHECK(sgpt_get_tensor(ctx, "layer.1000.weight") == NULL);
+
+  // the first tensor with a name is found, and renamed tensors move
+  sgpt_tensor* dup = sgpt_view_tensor(ctx, tensors[0]);
+  sgpt_set_name(ctx, dup, "layer.0.weight");
+  TEST_CHECK(sgpt_get_tensor(ctx, "layer.0.weight") == tensors[0]);
+  sgpt_set_name(ctx, tensors[0], "embedding");
+  TEST_CHECK(sgpt_get_tensor(ctx, "embedding") == tensors[0]);
+  TEST_CHECK(sgpt_get_tensor(ctx, "layer.0.weight") == dup);
+
+  sgpt_rollback(ctx, mark);
+  ok = true;
+  for (int i = 1; i < n; i++) {
+    snprintf(name, sizeof(name), "layer.%d.weight", i);
+    ok = ok && sgpt_get_tensor(ctx, name) == (i < n / 2 ? tensors[i] : NULL);
+  }
+  TEST_CHECK(ok);
+  TEST_CHECK(sgpt_get_tensor(ctx, "layer.0.weight") == NULL);
+  TEST_CHECK(sgpt_get_tensor(ctx, "embedding") == NULL);
+  sgpt_tensor* t = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 4);
+  sgpt_set_name(ctx, t, "layer.700.weight");
+  TEST_CHECK(sgpt_get_tensor(ctx, "layer.700.weight") == t);
+  sgpt_free(ctx);
+}
+
+void test_add_f32(void) {
+  static uint8_t mem_buffer[16384];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 16384,
+      .mem_buffer = (void*)mem_buffer,
+  });
+
+  // long enough to cover the unrolled, vector and tail loops
+  sgpt_tensor* a = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 133, 3);
+  sgpt_tensor* b = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 133, 3);
+  sgpt_tensor* c = sgpt_add(ctx, a, b);
+  sgpt_tensor* d = sgpt_dup(ctx, c);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, d);
+  float* a_data = a->data;
+  float* b_data = b->data;
+  for (int i = 0; i < 133 * 3; i++) {
+    a_data[i] = 0.5f * i;
+    b_data[i] = 0.25f * i;
+  }
+  sgpt_graph_compute(ctx, gf);
+
+  const float* d_data = d->data;
+  for (int i = 0; i < 133 * 3; i++) {
+    TEST_CHECK(d_data[i] == 0.75f * i);
+  }
+  sgpt_free(ctx);
+}
+
+void test_add_broadcast(void) {
+  static uint8_t mem_buffer[16384];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(mem_buffer),
+      .mem_buffer = (void*)mem_buffer,
+  });
+
+  sgpt_tensor* a = sgpt_new_tensor_3d(ctx, SGPT_TYPE_I32, 37, 4, 2);
+  sgpt_tensor* row = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 37);
+  sgpt_tensor* scalar = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, 1);
+  sgpt_tensor* col = sgpt_new_tensor_3d(ctx, SGPT_TYPE_I32, 1, 4, 1);
+  sgpt_tensor* x = sgpt_add(ctx, a, row);
+  sgpt_tensor* y = sgpt_add(ctx, x, scalar);
+  sgpt_tensor* z = sgpt_add_inplace(ctx, y, col);
+  TEST_CHECK(z->ne[0] == 37 && z->ne[1] == 4 && z->ne[2] == 2);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 8);
+  sgpt_build_forward_expand(gf, z);
+  for (int i2 = 0; i2 < 2; i2++) {
+    for (int i1 = 0; i1 < 4; i1++) {
+      for (int i0 = 0; i0 < 37; i0++) {
+        sgpt_set_i32_3d(a, i0, i1, i2, 10000 * i2 + 100 * i1);
+      }
+    }
+  }
+  for (int i0 = 0; i0 < 37; i0++) sgpt_set_i32_1d(row, i0, i0);
+  sgpt_set_i32_1d(scalar, 0, 1000000);
+  for (int i1 = 0; i1 < 4; i1++) sgpt_set_i32_3d(col, 0, i1, 0, 1000 * i1);
+  sgpt_graph_compute(ctx, gf);
+
+  bool ok = true;
+  for (int i2 = 0; i2 < 2; i2++) {
+    for (int i1 = 0; i1 < 4; i1++) {
+      for (int i0 = 0; i0 < 37; i0++) {
+        ok = ok && sgpt_get_i32_3d(z, i0, i1, i2) ==
+                       1000000 + 10000 * i2 + 1100 * i1 + i0;
+      }
+    }
+  }
+  TEST_CHECK(ok);
+  sgpt_free(ctx);
+}
+
+void test_half_types(void) {
+  TEST_CHECK(sgpt_fp32_to_fp16(1.0f) == 0x3c00);
+  TEST_CHECK(sgpt_fp32_to_fp16(-2.0f) == 0xc000);
+  TEST_CHECK(sgpt_fp32_to_fp16(65504.0f) == 0x7bff);
+  TEST_CHECK(sgpt_fp32_to_fp16(1e6f) == 0x7c00);
+  // ties round to even
+  TEST_CHECK(sgpt_fp32_to_fp16(1.0f + 0x1.0p-11f) == 0x3c00);
+  TEST_CHECK(sgpt_fp32_to_fp16(1.0f + 0x1.8p-10f) == 0x3c02);
+  TEST_CHECK(sgpt_fp16_to_fp32(0x3555) == 0x1.554p-2f);
+  TEST_CHECK(sgpt_fp32_to_bf16(1.0f) == 0x3f80);
+  TEST_CHECK(sgpt_fp32_to_bf16(1.0f + 0x1.0p-8f) == 0x3f80);
+  TEST_CHECK(sgpt_fp32_to_bf16(1.0f + 0x1.8p-7f) == 0x3f82);
+  TEST_CHECK(sgpt_bf16_to_fp32(0xc0a0) == -5.0f);
+
+  // the vector conversions agree with the scalar ones
+  enum { n = 1000 };
+  float x[n];
+  for (int i = 0; i < n; i++) x[i] = (float)(i * 7919 % 20011 - 10000) * 0.37f;
+  sgpt_fp16_t h[n];
+  sgpt_bf16_t b[n];
+  float y[n];
+  sgpt_fp32_to_fp16_row(x, h, n);
+  sgpt_fp32_to_bf16_row(x, b, n);
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    ok = ok && h[i] == sgpt_fp32_to_fp16(x[i]);
+    ok = ok && b[i] == sgpt_fp32_to_bf16(x[i]);
+  }
+  sgpt_fp16_to_fp32_row(h, y, n);
+  for (int i = 0; i < n; i++) ok = ok && y[i] == sgpt_fp16_to_fp32(h[i]);
+  sgpt_bf16_to_fp32_row(b, y, n);
+  for (int i = 0; i < n; i++) ok = ok && y[i] == sgpt_bf16_to_fp32(b[i]);
+  TEST_CHECK(ok);
+
+  uint8_t mem_buffer[8192];
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = sizeof(mem_buffer),
+      .mem_buffer = (void*)mem_buffer,
+  });
+  sgpt_tensor* a = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 37, 3);
+  sgpt_tensor* bias = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, 37);
+  sgpt_tensor* a16 = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F16, 37, 3);
+  sgpt_tensor* c16 = sgpt_new_tensor_2d(ctx, SGPT_TYPE_BF16, 37, 3);
+  sgpt_tensor* out = sgpt_new_tensor_2d(ctx, SGPT_TYPE_F32, 37, 3);
+  TEST_CHECK(a16->nb[0] == 2 && a16->nb[1] == 74);
+  sgpt_tensor* s16 = sgpt_add_inplace(ctx, sgpt_cpy(ctx, a, a16), bias);
+  sgpt_tensor* c = sgpt_cpy(ctx, s16, c16);
+  sgpt_tensor* d = sgpt_cpy(ctx, sgpt_add(ctx, c, c), out);
+  TEST_CHECK(s16->type == SGPT_TYPE_F16 && c->type == SGPT_TYPE_BF16);
+  TEST_CHECK(d->data == out->data);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 16);
+  sgpt_build_forward_expand(gf, d);
+  float* a_data = a->data;
+  float* bias_data = bias->data;
+  for (int i = 0; i < 37 * 3; i++) a_data[i] = 0.5f * i - 20.0f;
+  for (int i = 0; i < 37; i++) bias_data[i] = (float)i;
+  sgpt_graph_compute(ctx, gf);
+
+  const float* out_data = out->data;
+  ok = true;
+  for (int i = 0; i < 37 * 3; i++) {
+    ok = ok && out_data[i] == 2.0f * (a_data[i] + bias_data[i % 37]);
+  }
+  TEST_CHECK(ok);
+  sgpt_free(ctx);
+}
+
+// Largest distance between x and y over each block of SGPT_QK values, relative
+// to the largest magnitude in the block of x.
+static float quant_error(const float* x, const float* y, int n) {
+  float err = 0.0f;
+  for (int i = 0; i < n; i += SGPT_QK) {
+    float amax = 0.0f;
+    float dmax = 0.0f;
+    for (int j = i; j < i + SGPT_QK; j++) {
+      const float a = x[j] < 0.0f ? -x[j] : x[j];
+      const float d = x[j] < y[j] ? y[j] - x[j] : x[j] - y[j];
+      if (a > amax) amax = a;
+      if (d > dmax) dmax = d;
+    }
+    if (amax > 0.0f && dmax / amax > err) err = dmax / amax;
+  }
+  return err;
+}
+
+void test_quantized(void) {
+  TEST_CHECK(sgpt_blck_size(SGPT_TYPE_Q8_0) == SGPT_QK);
+  TEST_CHECK(sgpt_type_size(SGPT_TYPE_Q8_0) == 34);
+  TEST_CHECK(sgpt_row_size(SGPT_TYPE_Q4_0, 64) == 36);
+  TEST_CHECK(sgpt_row_size(SGPT_TYPE_F16, 64) == 128);
+
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 512 * 1024,
+      .mem_buffer = NULL,
+      .n_threads = 2,
+  });
+  // two tasks split the single row, on block boundaries
+  const int n = SGPT_QK * 300;
+  sgpt_tensor* x = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  sgpt_tensor* q8 = sgpt_new_tensor_1d(ctx, SGPT_TYPE_Q8_0, n);
+  sgpt_tensor* q4 = sgpt_new_tensor_1d(ctx, SGPT_TYPE_Q4_0, n);
+  sgpt_tensor* y8 = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  sgpt_tensor* y4 = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  sgpt_tensor* s8 = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  TEST_CHECK(q8->nb[0] == 34 && q8->nb[1] == 34 * 300);
+  TEST_CHECK(q4->nb[0] == 18 && q4->nb[1] == 18 * 300);
+
+  sgpt_tensor* c8 = sgpt_cpy(ctx, x, q8);
+  sgpt_tensor* c4 = sgpt_cpy(ctx, x, q4);
+  sgpt_tensor* d8 = sgpt_cpy(ctx, c8, y8);
+  sgpt_tensor* d4 = sgpt_cpy(ctx, c4, y4);
+  // q8 + x is quantized again in place, after d8 reads q8
+  sgpt_tensor* sum = sgpt_add_inplace(ctx, c8, x);
+  TEST_CHECK(sum->type == SGPT_TYPE_Q8_0);
+  sgpt_tensor* d_sum = sgpt_cpy(ctx, sum, s8);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 16);
+  sgpt_build_forward_expand(gf, d8);
+  sgpt_build_forward_expand(gf, d4);
+  sgpt_build_forward_expand(gf, d_sum);
+  float* x_data = x->data;
+  uint32_t seed = 1;
+  for (int i = 0; i < n; i++) {
+    seed = seed * 1664525u + 1013904223u;
+    x_data[i] = (float)((int)(seed >> 16) % 2000 - 1000) * 0.01f;
+  }
+  sgpt_graph_compute(ctx, gf);
+
+  // half a quantization step plus the rounding of the f16 scale, q4_0 clamps
+  // the opposite end of [-8, 7] to a whole step
+  const float err8 = quant_error(x_data, y8->data, n);
+  const float err4 = quant_error(x_data, y4->data, n);
+  TEST_CHECK_(err8 <= 0.5f / 127 + 1e-3f, "q8_0 error %g", err8);
+  TEST_CHECK_(err4 <= 1.0f / 8 + 1e-3f, "q4_0 error %g", err4);
+  float* expected = malloc(sizeof(float) * n);
+  const float* y8_data = y8->data;
+  for (int i = 0; i < n; i++) expected[i] = y8_data[i] + x_data[i];
+  const float err_sum = quant_error(expected, s8->data, n);
+  TEST_CHECK_(err_sum <= 0.5f / 127 + 1e-3f, "q8_0 sum error %g", err_sum);
+  free(expected);
+  sgpt_free(ctx);
+}
+
+void test_cast(void) {
+  TEST_CHECK(sgpt_promote_type(SGPT_TYPE_I32, SGPT_TYPE_I32) == SGPT_TYPE_I32);
+  TEST_CHECK(sgpt_promote_type(SGPT_TYPE_F16, SGPT_TYPE_BF16) ==
+             SGPT_TYPE_F32);
+  TEST_CHECK(sgpt_promote_type(SGPT_TYPE_I32, SGPT_TYPE_F16) == SGPT_TYPE_F32);
+
+  sgpt_context* ctx = sgpt_init((sgpt_init_params){
+      .mem_size = 64 * 1024,
+      .mem_buffer = NULL,
+  });
+  enum { n = 1001 };
+  sgpt_tensor* a = sgpt_new_tensor_1d(ctx, SGPT_TYPE_I32, n);
+  sgpt_tensor* b = sgpt_new_tensor_1d(ctx, SGPT_TYPE_F32, n);
+  sgpt_tensor* af = sgpt_cast(ctx, a, SGPT_TYPE_F32);
+  sgpt_tensor* bi = sgpt_cast(ctx, b, SGPT_TYPE_I32);
+  sgpt_tensor* ab = sgpt_add(ctx, a, b);
+  sgpt_tensor* h = sgpt_add(ctx, sgpt_cast(ctx, a, SGPT_TYPE_F16),
+                            sgpt_cast(ctx, a, SGPT_TYPE_BF16));
+  TEST_CHECK(af->type == SGPT_TYPE_F32 && bi->type == SGPT_TYPE_I32);
+  TEST_CHECK(ab->type == SGPT_TYPE_F32 && h->type == SGPT_TYPE_F32);
+
+  sgpt_cgraph* gf = sgpt_new_graph(ctx, 16);
+  sgpt_build_forward_expand(gf, af);
+  sgpt_build_forward_expand(gf, bi);
+  sgpt_build_forward_expand(gf, ab);
+  sgpt_build_forward_expand(gf, h);
+  int32_t* a_data = a->data;
+  float* b_data = b->data;
+  for (int i = 0; i < n; i++) {
+    a_data[i] = i - 500;
+    b_data[i] = (float)(i - 500) * 0.75f;
+  }
+  sgpt_graph_compute(ctx, gf);
+
+  const float* af_data = af->data;
+  const int32_t* bi_data = bi->data;
+  const float* ab_data = ab->data;
+  const float* h_data = h->data;
+  bool ok = true;
+  for (int i = 0; i < n; i++) {
+    ok = ok && af_data[i] == (float)(i - 500);
+    // truncated toward zero
+    ok = ok && bi_data[i] == (int32_t)((float)(i - 500) * 0.75f);
+    ok = ok && ab_data[i] == (float)(i - 500) * 1.75f;
+    // both half types hold integers of up to 256 exactly
+    if (i >= 244 && i <= 756) ok = ok && h_data[i] == 2.0f * (i - 500);
+  }
+  TEST_CHECK(ok);
+  TEST_CHECK(bi_data[0] == -375 && bi_data[1] == -374);
+  sgpt_free(ctx);
 }
 
 TEST_LIST = {
     {"init", test_init},
+    {"init_independent", test_init_independent},
+    {"init_parallel", test_init_parallel},
+    {"init_many", test_init_many},
+    {"init_owned_buffer", test_init_owned_buffer},
+    {"init_alloc_failure", test_init_alloc_failure},
     {"new_tensor", test_new_tensor},
+    {"new_tensor_aligned", test_new_tensor_aligned},
+    {"rollback", test_rollback},
+    {"measure", test_measure},
     {"set_i32", test_set_i32},
     {"dup_tensor", test_dup_tensor},
     {"view_tensor", test_view_tensor},
+    {"view_strided", test_view_strided},
     {"dup", test_dup},
+    {"dup_strided", test_dup_strided},
     {"dup_inplace", test_dup_inplace},
     {"add", test_add},
     {"add_inplace", test_add_inplace},
+    {"build_forward", test_build_forward},
+    {"build_forward_deep", test_build_forward_deep},
+    {"graph_reset", test_graph_reset},
+    {"graph_alloc", test_graph_alloc},
+    {"graph_alloc_output", test_graph_alloc_output},
+    {"graph_fuse", test_graph_fuse},
+    {"graph_fuse_output", test_graph_fuse_output},
+    {"add_multi_thread", test_add_multi_thread},
+    {"plan_execute", test_plan_execute},
+    {"plan_execute_empty", test_plan_execute_empty},
+    {"graph_profile", test_graph_profile},
+    {"graph_dump", test_graph_dump},
+    {"save_load", test_save_load},
+    {"named_tensors", test_named_tensors},
+    {"add_f32", test_add_f32},
+    {"add_broadcast", test_add_broadcast},
+    {"half_types", test_half_types},
+    {"quantized", test_quantized},
+    {"cast", test_cast},
     {NULL, NULL},
 };